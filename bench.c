@@ -1,10 +1,29 @@
+#ifndef _WIN32
+/* for socketpair() and fork() in strict ANSI builds */
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+#endif
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #ifdef _WIN32
 #include <windows.h>
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #endif
 #include "netbufs.h"
+#ifdef NETBUFS_HAVE_URING
+#include "netbufs-uring.h"
+#endif
 
 #define LIMIT 3000000
 #define JLIMIT 20
@@ -12,7 +31,11 @@ static unsigned int ntotal_alloc = 0;
 
 const char foo[100] = { 'f', 'o', 'o' };
 
-int main(void)
+/**
+ * Reserve and release spans of increasing size in order. This is the
+ * 'common' case of a request/response workload.
+ */
+static void bench_reserve_release(void)
 {
     int ii;
     nb_MGR mgr;
@@ -36,6 +59,1354 @@ int main(void)
             netbuf_mblock_release(&mgr, spans + jj);
         }
     }
+    printf("  allocs=%u\n", mgr.total_allocs);
     netbuf_cleanup(&mgr);
+}
+
+#define AVAIL_LIMIT 20000
+#define AVAIL_NSPANS 64
+
+/**
+ * Cycle spans of widely different sizes, each one larger than the base
+ * allocation, so that the available list is populated by blocks of many
+ * different (doubled) sizes.
+ */
+static void bench_avail_lookup(void)
+{
+    int ii;
+    nb_MGR mgr;
+    nb_SETTINGS settings;
+    netbuf_default_settings(&settings);
+    settings.data_basealloc = 1024;
+    settings.data_cacheblocks = 0;
+    /** Keep every emptied block around for reuse */
+    settings.data_maxavail = AVAIL_NSPANS;
+    settings.data_maxavailbytes = (nb_SIZE)-1;
+    netbuf_init(&mgr, &settings);
+
+    srand(0);
+    for (ii = 0; ii < AVAIL_LIMIT; ii++) {
+        int jj;
+        nb_SPAN spans[AVAIL_NSPANS];
+
+        for (jj = 0; jj < AVAIL_NSPANS; jj++) {
+            spans[jj].size = 1024 << (rand() % 8);
+            netbuf_mblock_reserve(&mgr, spans + jj);
+        }
+
+        for (jj = 0; jj < AVAIL_NSPANS; jj++) {
+            netbuf_mblock_release(&mgr, spans + jj);
+        }
+    }
+
+    printf("  lookups=%u, probes=%u (%.2f per lookup), allocs=%u\n",
+           mgr.datapool.avail_lookups, mgr.datapool.avail_probes,
+           (double)mgr.datapool.avail_probes / mgr.datapool.avail_lookups,
+           mgr.total_allocs);
+    netbuf_cleanup(&mgr);
+}
+
+/**
+ * Flush deep send queues of non-contiguous IOVs. The per-IOV cost should not
+ * depend on the number of blocks holding the queue elements.
+ */
+static void bench_sendq_flush(void)
+{
+    static char buf[2 * 65536];
+    unsigned int depth;
+
+    for (depth = 1024; depth <= 65536; depth *= 8) {
+        nb_MGR mgr;
+        unsigned int ii, round;
+        clock_t begin = clock();
+
+        netbuf_init(&mgr, NULL);
+        for (round = 0; round < 2097152 / depth; round++) {
+            for (ii = 0; ii < depth; ii++) {
+                nb_IOV iov;
+                iov.iov_base = buf + (ii * 2);
+                iov.iov_len = 1;
+                netbuf_enqueue(&mgr, &iov);
+            }
+
+            while (1) {
+                nb_IOV iovs[64];
+                nb_SIZE nb = netbuf_start_flush(&mgr, iovs, 64, NULL);
+                if (!nb) {
+                    break;
+                }
+                netbuf_end_flush(&mgr, nb);
+            }
+        }
+        printf("  depth=%u: %.1fns/iov\n", depth,
+               (double)(clock() - begin) * 1e9 / CLOCKS_PER_SEC / 2097152);
+        netbuf_cleanup(&mgr);
+    }
+}
+
+#define OOO_LIMIT 20000
+#define OOO_NSPANS 256
+
+/**
+ * Release spans in a shuffled order, as happens when responses arrive out
+ * of order.
+ */
+static void bench_ooo_release(void)
+{
+    int ii;
+    nb_MGR mgr;
+    nb_SPAN spans[OOO_NSPANS];
+    int order[OOO_NSPANS];
+
+    netbuf_init(&mgr, NULL);
+    srand(0);
+
+    for (ii = 0; ii < OOO_NSPANS; ii++) {
+        order[ii] = ii;
+    }
+
+    for (ii = 0; ii < OOO_LIMIT; ii++) {
+        int jj;
+
+        for (jj = 0; jj < OOO_NSPANS; jj++) {
+            spans[jj].size = 64;
+            netbuf_mblock_reserve(&mgr, spans + jj);
+        }
+
+        for (jj = OOO_NSPANS - 1; jj > 0; jj--) {
+            int kk = rand() % (jj + 1), tmp = order[jj];
+            order[jj] = order[kk];
+            order[kk] = tmp;
+        }
+
+        for (jj = 0; jj < OOO_NSPANS; jj++) {
+            netbuf_mblock_release(&mgr, spans + order[jj]);
+        }
+    }
+
+    printf("  allocs=%u, bytes=%u\n", mgr.total_allocs, mgr.total_bytes);
+    netbuf_cleanup(&mgr);
+}
+
+#define UNLINK_LIMIT 2000
+#define UNLINK_NBLOCKS 512
+
+/**
+ * Keep hundreds of blocks active, and empty them starting with the most
+ * recent one, so that each emptied block is far from the head of the list.
+ */
+static void bench_active_unlink(void)
+{
+    int ii;
+    nb_MGR mgr;
+    nb_SETTINGS settings;
+    nb_SPAN spans[UNLINK_NBLOCKS];
+
+    netbuf_default_settings(&settings);
+    settings.data_basealloc = 256;
+    settings.data_maxavail = UNLINK_NBLOCKS;
+    settings.data_maxavailbytes = (nb_SIZE)-1;
+    netbuf_init(&mgr, &settings);
+
+    for (ii = 0; ii < UNLINK_LIMIT; ii++) {
+        int jj;
+
+        for (jj = 0; jj < UNLINK_NBLOCKS; jj++) {
+            spans[jj].size = 256;
+            netbuf_mblock_reserve(&mgr, spans + jj);
+        }
+
+        for (jj = UNLINK_NBLOCKS - 1; jj >= 0; jj--) {
+            netbuf_mblock_release(&mgr, spans + jj);
+        }
+    }
+    netbuf_cleanup(&mgr);
+}
+
+#define PLACEMENT_LIMIT 2000000
+#define PLACEMENT_WINDOW 256
+
+/**
+ * Keep a window of live spans of mixed sizes, releasing a random one for each
+ * new reservation, and report the memory used with each placement policy.
+ */
+static void bench_placement(void)
+{
+    static const char *names[] = { "last", "scan", "fit" };
+    int policy;
+
+    for (policy = NB_PLACEMENT_LAST; policy <= NB_PLACEMENT_FIT; policy++) {
+        nb_MGR mgr;
+        nb_SETTINGS settings;
+        nb_SPAN spans[PLACEMENT_WINDOW];
+        unsigned int peak = 0;
+        double sum = 0;
+        int ii;
+        clock_t begin = clock();
+
+        netbuf_default_settings(&settings);
+        settings.data_cacheblocks = 0;
+        settings.data_placement = (nb_PLACEMENT)policy;
+        netbuf_init(&mgr, &settings);
+        srand(0);
+
+        for (ii = 0; ii < PLACEMENT_WINDOW; ii++) {
+            spans[ii].size = 64 << (rand() % 8);
+            netbuf_mblock_reserve(&mgr, spans + ii);
+        }
+
+        for (ii = 0; ii < PLACEMENT_LIMIT; ii++) {
+            nb_SPAN *span = spans + (rand() % PLACEMENT_WINDOW);
+            netbuf_mblock_release(&mgr, span);
+            span->size = 64 << (rand() % 8);
+            netbuf_mblock_reserve(&mgr, span);
+
+            if (mgr.total_bytes > peak) {
+                peak = mgr.total_bytes;
+            }
+            sum += mgr.total_bytes;
+        }
+
+        printf("  %s: peak=%uKB, avg=%.0fKB, allocs=%u, %.3fs\n",
+               names[policy], peak / 1024, sum / PLACEMENT_LIMIT / 1024,
+               mgr.total_allocs,
+               (double)(clock() - begin) / CLOCKS_PER_SEC);
+
+        for (ii = 0; ii < PLACEMENT_WINDOW; ii++) {
+            netbuf_mblock_release(&mgr, spans + ii);
+        }
+        netbuf_cleanup(&mgr);
+    }
+}
+
+#define FIRSTREQ_LIMIT 2000
+
+/**
+ * Measure the cost of filling every cache block of a freshly initialized
+ * manager, with and without a preallocated slab. Initialization itself is
+ * not timed.
+ */
+static void bench_first_request(void)
+{
+    static const nb_SIZE modes[] = {
+        0, NB_PREALLOC_DATA, NB_PREALLOC_DATA | NB_PREALLOC_PREFAULT
+    };
+    static const char *names[] = { "none", "slab", "slab+prefault" };
+    unsigned int mode;
+
+    for (mode = 0; mode < 3; mode++) {
+        clock_t elapsed = 0;
+        int ii;
+
+        for (ii = 0; ii < FIRSTREQ_LIMIT; ii++) {
+            nb_MGR mgr;
+            nb_SETTINGS settings;
+            nb_SPAN spans[NB_DATA_CACHEBLOCKS];
+            clock_t begin;
+            int jj;
+
+            netbuf_default_settings(&settings);
+            settings.prealloc = modes[mode];
+            netbuf_init(&mgr, &settings);
+
+            begin = clock();
+            for (jj = 0; jj < NB_DATA_CACHEBLOCKS; jj++) {
+                spans[jj].size = NB_DATA_BASEALLOC;
+                netbuf_mblock_reserve(&mgr, spans + jj);
+                memset(SPAN_BUFFER(spans + jj), 'x', spans[jj].size);
+            }
+            elapsed += clock() - begin;
+
+            for (jj = 0; jj < NB_DATA_CACHEBLOCKS; jj++) {
+                netbuf_mblock_release(&mgr, spans + jj);
+            }
+            netbuf_cleanup(&mgr);
+        }
+        printf("  %s: %.1fus per manager\n", names[mode],
+               (double)elapsed * 1e6 / CLOCKS_PER_SEC / FIRSTREQ_LIMIT);
+    }
+}
+
+#define LARGE_LIMIT 200
+#define LARGE_NSPANS 64
+#define LARGE_SPANSIZE (1024 * 1024)
+
+/**
+ * Copy into large spans spread over many 2MB blocks, with the block buffers
+ * allocated normally, mapped, and mapped with transparent huge pages.
+ */
+static void bench_large_copy(void)
+{
+    static const char *names[] = { "malloc", "mmap", "mmap+thp" };
+    char *src = malloc(LARGE_SPANSIZE);
+    int mode;
+
+    memset(src, 'x', LARGE_SPANSIZE);
+
+    for (mode = 0; mode < 3; mode++) {
+        nb_MGR mgr;
+        nb_SETTINGS settings;
+        nb_SPAN spans[LARGE_NSPANS];
+        clock_t begin;
+        int ii;
+
+        netbuf_default_settings(&settings);
+        settings.data_basealloc = 2 * 1024 * 1024;
+        settings.data_cacheblocks = 0;
+        settings.data_maxavail = LARGE_NSPANS;
+        settings.data_maxavailbytes = (nb_SIZE)-1;
+        if (mode > 0) {
+            settings.data_mmap_threshold = settings.data_basealloc;
+        }
+        if (mode > 1) {
+            settings.data_mmap_flags = NB_MMAP_THP;
+        }
+        netbuf_init(&mgr, &settings);
+
+        begin = clock();
+        for (ii = 0; ii < LARGE_LIMIT; ii++) {
+            int jj;
+            for (jj = 0; jj < LARGE_NSPANS; jj++) {
+                spans[jj].size = LARGE_SPANSIZE;
+                netbuf_mblock_reserve(&mgr, spans + jj);
+                memcpy(SPAN_BUFFER(spans + jj), src, LARGE_SPANSIZE);
+            }
+            for (jj = 0; jj < LARGE_NSPANS; jj++) {
+                netbuf_mblock_release(&mgr, spans + jj);
+            }
+        }
+        printf("  %s: %.2fGB/s\n", names[mode],
+               (double)LARGE_LIMIT * LARGE_NSPANS * LARGE_SPANSIZE /
+               ((double)(clock() - begin) / CLOCKS_PER_SEC) / 1e9);
+        netbuf_cleanup(&mgr);
+    }
+    free(src);
+}
+
+#define LARGESPAN_LIMIT 200000
+#define LARGESPAN_WINDOW 256
+
+/**
+ * Keep a window of live spans, mostly small with the occasional span of
+ * just over 1MB, and report how much allocated memory is not in use by
+ * any span, with and without the dedicated large span path.
+ */
+static void bench_large_spans(void)
+{
+    static const char *names[] = { "doubling", "largespan" };
+    int mode;
+
+    for (mode = 0; mode < 2; mode++) {
+        nb_MGR mgr;
+        nb_SETTINGS settings;
+        nb_SPAN spans[LARGESPAN_WINDOW];
+        double live = 0, wasted = 0;
+        unsigned int peak = 0;
+        int ii;
+
+        netbuf_default_settings(&settings);
+        if (mode) {
+            settings.data_largespan = settings.data_basealloc;
+        }
+        netbuf_init(&mgr, &settings);
+        srand(0);
+
+        for (ii = 0; ii < LARGESPAN_LIMIT + LARGESPAN_WINDOW; ii++) {
+            nb_SPAN *span = spans + (ii % LARGESPAN_WINDOW);
+
+            if (ii >= LARGESPAN_WINDOW) {
+                span = spans + (rand() % LARGESPAN_WINDOW);
+                live -= span->size;
+                netbuf_mblock_release(&mgr, span);
+            }
+
+            if (rand() % 100 < 2) {
+                span->size = 1100000 + rand() % 65536;
+            } else {
+                span->size = 64 + rand() % 4096;
+            }
+            netbuf_mblock_reserve(&mgr, span);
+            live += span->size;
+
+            if (ii >= LARGESPAN_WINDOW) {
+                wasted += mgr.total_bytes - live;
+                if (mgr.total_bytes > peak) {
+                    peak = mgr.total_bytes;
+                }
+            }
+        }
+
+        printf("  %s: avg wasted=%.0fKB, peak=%uKB, allocs=%u\n",
+               names[mode], wasted / LARGESPAN_LIMIT / 1024, peak / 1024,
+               mgr.total_allocs);
+
+        for (ii = 0; ii < LARGESPAN_WINDOW; ii++) {
+            netbuf_mblock_release(&mgr, spans + ii);
+        }
+        netbuf_cleanup(&mgr);
+    }
+}
+
+#define MANY_LIMIT 10000000
+
+/**
+ * Reserve a header, key and value span for each command, one at a time and
+ * with a single netbuf_mblock_reserve_many() call.
+ */
+static void bench_reserve_many(void)
+{
+    int mode;
+
+    for (mode = 0; mode < 2; mode++) {
+        nb_MGR mgr;
+        nb_SPAN spans[3];
+        clock_t begin;
+        unsigned int ii;
+
+        netbuf_init(&mgr, NULL);
+        begin = clock();
+
+        for (ii = 0; ii < MANY_LIMIT; ii++) {
+            int jj;
+            spans[0].size = 24;
+            spans[1].size = 16 + (ii & 15);
+            spans[2].size = 100 + (ii & 255);
+
+            if (mode) {
+                netbuf_mblock_reserve_many(&mgr, spans, 3);
+            } else {
+                for (jj = 0; jj < 3; jj++) {
+                    netbuf_mblock_reserve(&mgr, spans + jj);
+                }
+            }
+            for (jj = 0; jj < 3; jj++) {
+                netbuf_mblock_release(&mgr, spans + jj);
+            }
+        }
+
+        printf("  %s: %.1fns per command\n", mode ? "reserve_many" : "reserve",
+               (double)(clock() - begin) * 1e9 / CLOCKS_PER_SEC / MANY_LIMIT);
+        netbuf_cleanup(&mgr);
+    }
+}
+
+/**
+ * Release a shuffled batch of spans one at a time, and with a single
+ * netbuf_mblock_release_many() call.
+ */
+static void bench_release_many(void)
+{
+    int mode;
+
+    for (mode = 0; mode < 2; mode++) {
+        nb_MGR mgr;
+        nb_SPAN spans[OOO_NSPANS], batch[OOO_NSPANS];
+        int order[OOO_NSPANS];
+        clock_t begin;
+        int ii;
+
+        netbuf_init(&mgr, NULL);
+        srand(0);
+        for (ii = 0; ii < OOO_NSPANS; ii++) {
+            order[ii] = ii;
+        }
+
+        begin = clock();
+        for (ii = 0; ii < OOO_LIMIT; ii++) {
+            int jj;
+
+            for (jj = 0; jj < OOO_NSPANS; jj++) {
+                spans[jj].size = 64;
+                netbuf_mblock_reserve(&mgr, spans + jj);
+            }
+
+            for (jj = OOO_NSPANS - 1; jj > 0; jj--) {
+                int kk = rand() % (jj + 1), tmp = order[jj];
+                order[jj] = order[kk];
+                order[kk] = tmp;
+            }
+
+            if (mode) {
+                for (jj = 0; jj < OOO_NSPANS; jj++) {
+                    batch[jj] = spans[order[jj]];
+                }
+                netbuf_mblock_release_many(&mgr, batch, OOO_NSPANS);
+            } else {
+                for (jj = 0; jj < OOO_NSPANS; jj++) {
+                    netbuf_mblock_release(&mgr, spans + order[jj]);
+                }
+            }
+        }
+
+        printf("  %s: %.1fns per span\n", mode ? "release_many" : "release",
+               (double)(clock() - begin) * 1e9 / CLOCKS_PER_SEC /
+               OOO_LIMIT / OOO_NSPANS);
+        netbuf_cleanup(&mgr);
+    }
+}
+
+#define COMMIT_LIMIT 5000000
+#define COMMIT_WINDOW 64
+#define COMMIT_MAX 4096
+
+/**
+ * Serialize values of unknown length (up to COMMIT_MAX bytes) by keeping
+ * the maximum reservation, by copying into a second reservation of the
+ * actual size, and by truncating the maximum reservation.
+ */
+static void bench_commit_actual(void)
+{
+    static const char *names[] = { "over-reserve", "copy", "truncate" };
+    static char src[COMMIT_MAX];
+    int mode;
+
+    for (mode = 0; mode < 3; mode++) {
+        nb_MGR mgr;
+        nb_SPAN spans[COMMIT_WINDOW];
+        unsigned int peak = 0;
+        clock_t begin;
+        int ii;
+
+        netbuf_init(&mgr, NULL);
+        srand(0);
+        begin = clock();
+
+        for (ii = 0; ii < COMMIT_LIMIT; ii++) {
+            nb_SPAN *span = spans + (ii % COMMIT_WINDOW);
+            nb_SIZE actual = 64 + rand() % 960;
+
+            if (ii >= COMMIT_WINDOW) {
+                netbuf_mblock_release(&mgr, span);
+            }
+
+            span->size = COMMIT_MAX;
+            netbuf_mblock_reserve(&mgr, span);
+            memcpy(SPAN_BUFFER(span), src, actual);
+
+            if (mode == 1) {
+                nb_SPAN tmp = *span;
+                span->size = actual;
+                netbuf_mblock_reserve(&mgr, span);
+                memcpy(SPAN_BUFFER(span), SPAN_BUFFER(&tmp), actual);
+                netbuf_mblock_release(&mgr, &tmp);
+            } else if (mode == 2) {
+                netbuf_mblock_truncate(&mgr, span, actual);
+            }
+
+            if (mgr.total_bytes > peak) {
+                peak = mgr.total_bytes;
+            }
+        }
+
+        printf("  %s: %.1fns per value, peak=%uKB\n", names[mode],
+               (double)(clock() - begin) * 1e9 / CLOCKS_PER_SEC / COMMIT_LIMIT,
+               peak / 1024);
+
+        for (ii = 0; ii < COMMIT_WINDOW; ii++) {
+            netbuf_mblock_release(&mgr, spans + ii);
+        }
+        netbuf_cleanup(&mgr);
+    }
+}
+
+#define WRITER_LIMIT 20000
+#define WRITER_WINDOW 8
+
+/**
+ * Emit PDUs of 40-200KB in 1KB pieces, either into one span reserved for the
+ * whole PDU (which requires knowing its size in advance), or with a writer.
+ * Each PDU is enqueued and flushed, and released once it falls out of a
+ * small window.
+ */
+static void bench_writer(void)
+{
+    static char piece[1024];
+    int mode;
+
+    for (mode = 0; mode < 2; mode++) {
+        nb_MGR mgr;
+        nb_SPAN spans[WRITER_WINDOW];
+        nb_WRITER writers[WRITER_WINDOW];
+        unsigned int peak = 0;
+        clock_t begin;
+        int ii;
+
+        netbuf_init(&mgr, NULL);
+        for (ii = 0; ii < WRITER_WINDOW; ii++) {
+            netbuf_writer_init(writers + ii, &mgr);
+        }
+        srand(0);
+        begin = clock();
+
+        for (ii = 0; ii < WRITER_LIMIT; ii++) {
+            int slot = ii % WRITER_WINDOW;
+            nb_SIZE npieces = 40 + rand() % 160, jj;
+
+            if (mode) {
+                netbuf_writer_release(writers + slot);
+                for (jj = 0; jj < npieces; jj++) {
+                    netbuf_writer_append(writers + slot, piece, sizeof(piece));
+                }
+                netbuf_writer_end(writers + slot);
+            } else {
+                if (ii >= WRITER_WINDOW) {
+                    netbuf_mblock_release(&mgr, spans + slot);
+                }
+                spans[slot].size = npieces * sizeof(piece);
+                netbuf_mblock_reserve(&mgr, spans + slot);
+                for (jj = 0; jj < npieces; jj++) {
+                    memcpy((char *)SPAN_BUFFER(spans + slot) + jj * sizeof(piece),
+                           piece, sizeof(piece));
+                }
+                netbuf_enqueue_span(&mgr, spans + slot);
+            }
+
+            while (1) {
+                nb_IOV iovs[64];
+                nb_SIZE nb = netbuf_start_flush(&mgr, iovs, 64, NULL);
+                if (!nb) {
+                    break;
+                }
+                netbuf_end_flush(&mgr, nb);
+            }
+
+            if (mgr.total_bytes > peak) {
+                peak = mgr.total_bytes;
+            }
+        }
+
+        printf("  %s: %.1fus per PDU, peak=%uKB, allocs=%u\n",
+               mode ? "writer" : "span",
+               (double)(clock() - begin) * 1e6 / CLOCKS_PER_SEC / WRITER_LIMIT,
+               peak / 1024, mgr.total_allocs);
+
+        for (ii = 0; ii < WRITER_WINDOW; ii++) {
+            if (mode) {
+                netbuf_writer_release(writers + ii);
+            } else {
+                netbuf_mblock_release(&mgr, spans + ii);
+            }
+        }
+        netbuf_cleanup(&mgr);
+    }
+}
+
+#define ALIGNED_LIMIT 200000
+
+/**
+ * Reserve and release batches of spans of random sizes, unaligned and
+ * aligned to 64 bytes.
+ */
+static void bench_aligned(void)
+{
+    static const nb_SIZE aligns[] = { 1, 64 };
+    int mode;
+
+    for (mode = 0; mode < 2; mode++) {
+        nb_MGR mgr;
+        nb_SPAN spans[JLIMIT];
+        unsigned int peak = 0;
+        clock_t begin;
+        int ii;
+
+        netbuf_init(&mgr, NULL);
+        srand(0);
+        begin = clock();
+
+        for (ii = 0; ii < ALIGNED_LIMIT; ii++) {
+            int jj;
+            for (jj = 0; jj < JLIMIT; jj++) {
+                spans[jj].size = 16 + rand() % 512;
+                netbuf_mblock_reserve_aligned(&mgr, spans + jj, aligns[mode]);
+            }
+            if (mgr.total_bytes > peak) {
+                peak = mgr.total_bytes;
+            }
+            for (jj = 0; jj < JLIMIT; jj++) {
+                netbuf_mblock_release(&mgr, spans + ((jj * 7) % JLIMIT));
+            }
+        }
+
+        printf("  align=%u: %.1fns per span, peak=%uKB\n", aligns[mode],
+               (double)(clock() - begin) * 1e9 / CLOCKS_PER_SEC /
+               ALIGNED_LIMIT / JLIMIT, peak / 1024);
+        netbuf_cleanup(&mgr);
+    }
+}
+
+#define COPY_BYTES (2048U * 1024 * 1024)
+#define COPY_WINDOW (64 * 1024 * 1024)
+
+/**
+ * Copy payloads of various sizes into the send queue, either with
+ * reserve + memcpy + netbuf_enqueue_span(), or with netbuf_enqueue_copy().
+ * Enough payloads are kept live that the destination does not fit in the
+ * cache.
+ */
+static void bench_enqueue_copy(void)
+{
+    static const nb_SIZE sizes[] = { 512, 65536, 8 * 1024 * 1024 };
+    char *src = malloc(8 * 1024 * 1024);
+    unsigned int ii;
+
+    memset(src, 'x', 8 * 1024 * 1024);
+
+    for (ii = 0; ii < sizeof(sizes) / sizeof(*sizes); ii++) {
+        int mode;
+        printf("  %u bytes:", sizes[ii]);
+
+        for (mode = 0; mode < 2; mode++) {
+            nb_MGR mgr;
+            nb_SETTINGS settings;
+            nb_SPAN *spans;
+            nb_SIZE nwindow = COPY_WINDOW / sizes[ii], jj;
+            clock_t begin;
+
+            netbuf_default_settings(&settings);
+            settings.data_maxavail = 64;
+            settings.data_maxavailbytes = 2 * COPY_WINDOW;
+            netbuf_init(&mgr, &settings);
+            spans = calloc(nwindow, sizeof(*spans));
+            begin = clock();
+
+            for (jj = 0; jj < COPY_BYTES / sizes[ii]; jj++) {
+                nb_SPAN *span = spans + (jj % nwindow);
+                nb_IOV iov;
+
+                if (jj >= nwindow) {
+                    netbuf_mblock_release(&mgr, span);
+                }
+
+                iov.iov_base = src;
+                iov.iov_len = sizes[ii];
+                if (mode) {
+                    netbuf_enqueue_copy(&mgr, &iov, 1, span);
+                } else {
+                    span->size = sizes[ii];
+                    netbuf_mblock_reserve(&mgr, span);
+                    memcpy(SPAN_BUFFER(span), src, sizes[ii]);
+                    netbuf_enqueue_span(&mgr, span);
+                }
+
+                while (1) {
+                    nb_IOV iovs[8];
+                    nb_SIZE nb = netbuf_start_flush(&mgr, iovs, 8, NULL);
+                    if (!nb) {
+                        break;
+                    }
+                    netbuf_end_flush(&mgr, nb);
+                }
+            }
+
+            printf(" %s=%.2fGB/s", mode ? "enqueue_copy" : "reserve+memcpy",
+                   COPY_BYTES / ((double)(clock() - begin) / CLOCKS_PER_SEC)
+                   / 1e9);
+
+            for (jj = 0; jj < nwindow; jj++) {
+                netbuf_mblock_release(&mgr, spans + jj);
+            }
+            free(spans);
+            netbuf_cleanup(&mgr);
+        }
+        printf("\n");
+    }
+    free(src);
+}
+
+#define HYBRID_NBUFS 64
+#define HYBRID_ITERATIONS 100000
+
+/**
+ * Enqueues batches of small scattered buffers (headers, lengths and such),
+ * either referencing each one or letting netbuf_enqueue() copy them, and
+ * flushes each batch as a writev() would. Reports the number of IOVs
+ * produced per batch and the time taken per batch.
+ */
+static void bench_hybrid_copy(void)
+{
+    static char src[HYBRID_NBUFS * 64];
+    int mode;
+
+    for (mode = 0; mode < 2; mode++) {
+        nb_MGR mgr;
+        nb_SETTINGS settings;
+        unsigned long niovs = 0;
+        clock_t begin;
+        int ii, jj;
+
+        netbuf_default_settings(&settings);
+        settings.copy_threshold = mode ? 64 : 0;
+        netbuf_init(&mgr, &settings);
+        begin = clock();
+
+        for (ii = 0; ii < HYBRID_ITERATIONS; ii++) {
+            for (jj = 0; jj < HYBRID_NBUFS; jj++) {
+                nb_IOV iov;
+                iov.iov_base = src + jj * 64;
+                iov.iov_len = 8 + (jj % 4) * 8;
+                netbuf_enqueue(&mgr, &iov);
+            }
+
+            while (1) {
+                nb_IOV iovs[64];
+                int niov = 0;
+                nb_SIZE nb = netbuf_start_flush(&mgr, iovs, 64, &niov);
+                if (!nb) {
+                    break;
+                }
+                niovs += niov;
+                netbuf_end_flush(&mgr, nb);
+            }
+        }
+
+        printf("  %s: %.1f IOVs, %.2fus per batch\n",
+               mode ? "copied" : "referenced",
+               (double)niovs / HYBRID_ITERATIONS,
+               (double)(clock() - begin) / CLOCKS_PER_SEC * 1e6
+               / HYBRID_ITERATIONS);
+        netbuf_cleanup(&mgr);
+    }
+}
+
+#define FLUSH_FD_BYTES (1024U * 1024 * 1024)
+
+/**
+ * Stream data over a socketpair to a child process which discards it, with
+ * netbuf_flush_fd() and poll(). Each PDU is a single span of the given size,
+ * and is released once flushed. Reports wall clock throughput.
+ */
+static void bench_flush_fd(void)
+{
+#ifndef _WIN32
+    static const nb_SIZE sizes[] = { 256, 4096, 65536 };
+    unsigned int ii;
+
+    for (ii = 0; ii < sizeof(sizes) / sizeof(*sizes); ii++) {
+        nb_MGR mgr;
+        nb_SPAN spans[64];
+        struct timeval begin, end;
+        unsigned int nspans = 0, jj;
+        nb_SIZE sent = 0;
+        pid_t pid;
+        int fds[2];
+
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+            return;
+        }
+
+        pid = fork();
+        if (pid == 0) {
+            static char sink[262144];
+            close(fds[0]);
+            while (read(fds[1], sink, sizeof(sink)) > 0) {
+            }
+            _exit(0);
+        }
+        close(fds[1]);
+        fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+        netbuf_init(&mgr, NULL);
+        gettimeofday(&begin, NULL);
+
+        while (sent < FLUSH_FD_BYTES) {
+            nb_FLUSHSTATUS status;
+
+            /** Fill up a batch of PDUs */
+            for (; nspans < 64; nspans++) {
+                spans[nspans].size = sizes[ii];
+                netbuf_mblock_reserve(&mgr, spans + nspans);
+                memset(SPAN_BUFFER(spans + nspans), 'x', 16);
+                netbuf_enqueue_span(&mgr, spans + nspans);
+            }
+
+            status = netbuf_flush_fd(&mgr, fds[0], 0);
+            if (status == NB_FLUSH_ERROR) {
+                break;
+            } else if (status == NB_FLUSH_AGAIN) {
+                struct pollfd pfd;
+                pfd.fd = fds[0];
+                pfd.events = POLLOUT;
+                poll(&pfd, 1, -1);
+                continue;
+            }
+
+            for (jj = 0; jj < nspans; jj++) {
+                netbuf_mblock_release(&mgr, spans + jj);
+            }
+            sent += nspans * sizes[ii];
+            nspans = 0;
+        }
+
+        gettimeofday(&end, NULL);
+        printf("  %u bytes: %.2fGB/s\n", sizes[ii], sent /
+               ((end.tv_sec - begin.tv_sec) +
+                (end.tv_usec - begin.tv_usec) / 1e6) / 1e9);
+
+        close(fds[0]);
+        waitpid(pid, NULL, 0);
+        for (jj = 0; jj < nspans; jj++) {
+            netbuf_mblock_release(&mgr, spans + jj);
+        }
+        netbuf_cleanup(&mgr);
+    }
+#endif
+}
+
+#define URING_NCONNS 256
+#define URING_ROUNDS 2000
+
+/**
+ * Many connections each have a small PDU to write per event loop iteration.
+ * Compare one netbuf_flush_fd() call per connection against a single
+ * io_uring submission for all of them. Only the flushing is timed; the
+ * peers are drained by the same process afterwards.
+ */
+static void bench_uring(void)
+{
+#ifdef NETBUFS_HAVE_URING
+    static nb_MGR mgrs[URING_NCONNS];
+    static nb_URINGCONN conns[URING_NCONNS];
+    static int fds[URING_NCONNS][2];
+    static char pdu[512], sink[65536];
+    nb_URING ring;
+    int mode, ii, round;
+
+    if (netbuf_uring_init(&ring, URING_NCONNS) != 0) {
+        printf("  io_uring not available\n");
+        return;
+    }
+
+    for (ii = 0; ii < URING_NCONNS; ii++) {
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds[ii]);
+        fcntl(fds[ii][0], F_SETFL, fcntl(fds[ii][0], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[ii][1], F_SETFL, fcntl(fds[ii][1], F_GETFL) | O_NONBLOCK);
+        netbuf_init(mgrs + ii, NULL);
+        netbuf_uring_conn_init(conns + ii, mgrs + ii, fds[ii][1]);
+    }
+
+    for (mode = 0; mode < 2; mode++) {
+        double elapsed = 0;
+
+        for (round = 0; round < URING_ROUNDS; round++) {
+            struct timeval begin, end;
+            nb_IOV iov;
+            iov.iov_base = pdu;
+            iov.iov_len = sizeof(pdu);
+
+            gettimeofday(&begin, NULL);
+
+            if (mode) {
+                int nprepared = 0;
+                for (ii = 0; ii < URING_NCONNS; ii++) {
+                    netbuf_enqueue(mgrs + ii, &iov);
+                    nprepared += netbuf_uring_flush(&ring, conns + ii);
+                }
+                netbuf_uring_submit(&ring, nprepared);
+                netbuf_uring_complete(&ring, NULL);
+            } else {
+                for (ii = 0; ii < URING_NCONNS; ii++) {
+                    netbuf_enqueue(mgrs + ii, &iov);
+                    netbuf_flush_fd(mgrs + ii, fds[ii][1], 0);
+                }
+            }
+            gettimeofday(&end, NULL);
+            elapsed += (end.tv_sec - begin.tv_sec) * 1e6 +
+                    (end.tv_usec - begin.tv_usec);
+
+            for (ii = 0; ii < URING_NCONNS; ii++) {
+                while (read(fds[ii][0], sink, sizeof(sink)) > 0) {
+                }
+            }
+        }
+
+        printf("  %s: %.2fus to flush %d connections\n",
+               mode ? "io_uring" : "flush_fd", elapsed / URING_ROUNDS,
+               URING_NCONNS);
+    }
+
+    for (ii = 0; ii < URING_NCONNS; ii++) {
+        close(fds[ii][0]);
+        close(fds[ii][1]);
+        netbuf_cleanup(mgrs + ii);
+    }
+    netbuf_uring_cleanup(&ring);
+#else
+    printf("  not built with NETBUFS_HAVE_URING\n");
+#endif
+}
+
+#define ZEROCOPY_BYTES (1024U * 1024 * 1024)
+#define ZEROCOPY_SPANSIZE (256 * 1024)
+#define ZEROCOPY_BATCH 8
+
+#ifndef _WIN32
+/** Creates a connected pair of loopback TCP sockets */
+static int tcp_pair(int fds[2])
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int lsock = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (lsock < 0 ||
+            bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(lsock, 1) != 0 ||
+            getsockname(lsock, (struct sockaddr *)&addr, &addrlen) != 0) {
+        return -1;
+    }
+
+    fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fds[0], (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        return -1;
+    }
+    fds[1] = accept(lsock, NULL, NULL);
+    close(lsock);
+    return fds[1] < 0 ? -1 : 0;
+}
+#endif
+
+/**
+ * Stream large owned spans over loopback TCP to a forked reader, with and
+ * without MSG_ZEROCOPY. Note that loopback delivery copies the data anyway,
+ * so this mostly measures the overhead of the notifications; the benefit
+ * shows on real NICs.
+ */
+static void bench_zerocopy(void)
+{
+#ifndef _WIN32
+    int mode;
+
+    for (mode = 0; mode < 2; mode++) {
+        nb_MGR mgr;
+        struct timeval begin, end;
+        nb_SIZE sent = 0;
+        pid_t pid;
+        int fds[2];
+
+        if (tcp_pair(fds) != 0) {
+            printf("  loopback TCP not available\n");
+            return;
+        }
+
+        pid = fork();
+        if (pid == 0) {
+            static char sink[262144];
+            close(fds[0]);
+            while (read(fds[1], sink, sizeof(sink)) > 0) {
+            }
+            _exit(0);
+        }
+        close(fds[1]);
+        fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+        netbuf_init(&mgr, NULL);
+        if (mode && netbuf_zerocopy_enable(&mgr, fds[0]) != 0) {
+            printf("  MSG_ZEROCOPY not available\n");
+            close(fds[0]);
+            waitpid(pid, NULL, 0);
+            netbuf_cleanup(&mgr);
+            return;
+        }
+        gettimeofday(&begin, NULL);
+
+        while (sent < ZEROCOPY_BYTES) {
+            nb_FLUSHSTATUS status;
+            int ii;
+
+            for (ii = 0; ii < ZEROCOPY_BATCH; ii++) {
+                nb_SPAN span;
+                span.size = ZEROCOPY_SPANSIZE;
+                if (netbuf_mblock_reserve(&mgr, &span) != 0) {
+                    break;
+                }
+                memset(SPAN_BUFFER(&span), 'z', 64);
+                netbuf_enqueue_span_owned(&mgr, &span);
+            }
+
+            while ((status = netbuf_flush_fd(&mgr, fds[0], 0)) ==
+                    NB_FLUSH_AGAIN) {
+                struct pollfd pfd;
+                pfd.fd = fds[0];
+                pfd.events = POLLOUT;
+                poll(&pfd, 1, -1);
+                netbuf_zerocopy_complete(&mgr, fds[0]);
+            }
+            if (status == NB_FLUSH_ERROR) {
+                break;
+            }
+            netbuf_zerocopy_complete(&mgr, fds[0]);
+            sent += ZEROCOPY_BATCH * ZEROCOPY_SPANSIZE;
+        }
+
+        while (netbuf_get_zerocopy_pending(&mgr)) {
+            struct pollfd pfd;
+            pfd.fd = fds[0];
+            pfd.events = 0;
+            poll(&pfd, 1, 10);
+            netbuf_zerocopy_complete(&mgr, fds[0]);
+        }
+        gettimeofday(&end, NULL);
+        printf("  %s: %.2fGB/s", mode ? "zerocopy" : "copy",
+               sent / ((end.tv_sec - begin.tv_sec) +
+                       (end.tv_usec - begin.tv_usec) / 1e6) / 1e9);
+        if (mode) {
+            printf(", copied by kernel: %u", mgr.sendq.zc_copied);
+        }
+        printf("\n");
+
+        close(fds[0]);
+        waitpid(pid, NULL, 0);
+        netbuf_cleanup(&mgr);
+    }
+#endif
+}
+
+typedef struct {
+    const char *name;
+    void (*run)(void);
+} bench_ENTRY;
+
+#define RDBUF_STREAM (4 * 1024 * 1024)
+#define RDBUF_READSIZE 65536
+#define RDBUF_MAXVALUE 17408
+#define RDBUF_ITERATIONS 50
+
+/**
+ * Parse a stream of length-prefixed values, received in 64KB reads, where
+ * each value is handed to the application as a span. Compares copying reads
+ * into a flat buffer and then each value into its own span, against reading
+ * into an nb_RDBUF and referencing the values in place. Reads are simulated
+ * with memcpy().
+ */
+static void bench_rdbuf(void)
+{
+    static const unsigned int minsizes[] = { 16, 1024 };
+    static const unsigned int ranges[] = { 1025, 16385 };
+    static char stream[RDBUF_STREAM + 2];
+    static char flat[RDBUF_READSIZE + RDBUF_MAXVALUE + 2];
+    unsigned int sz;
+
+    for (sz = 0; sz < sizeof(minsizes) / sizeof(*minsizes); sz++) {
+        unsigned int pos;
+        int mode;
+
+        for (pos = 0; pos + 2 + RDBUF_MAXVALUE <= RDBUF_STREAM; ) {
+            unsigned int vlen = minsizes[sz] + (pos * 13) % ranges[sz];
+            stream[pos] = (char)(vlen >> 8);
+            stream[pos + 1] = (char)vlen;
+            pos += 2 + vlen;
+        }
+        memset(stream + pos, 0, sizeof(stream) - pos);
+        printf("  values of %u..%u bytes\n", minsizes[sz],
+               minsizes[sz] + ranges[sz] - 1);
+
+        for (mode = 0; mode < 2; mode++) {
+            nb_MGR mgr;
+            nb_RDBUF rdbuf;
+            nb_SPAN spans[2];
+            clock_t begin;
+            int ii;
+
+            netbuf_init(&mgr, NULL);
+            netbuf_rdbuf_init(&rdbuf, &mgr);
+            begin = clock();
+
+            for (ii = 0; ii < RDBUF_ITERATIONS; ii++) {
+                nb_SIZE fed = 0, have = 0;
+
+                while (fed < RDBUF_STREAM) {
+                    nb_SIZE vlen, nread = RDBUF_STREAM - fed;
+                    unsigned char hdr[2];
+
+                    if (nread > RDBUF_READSIZE) {
+                        nread = RDBUF_READSIZE;
+                    }
+
+                    if (mode == 0) {
+                        nb_SIZE off = 0;
+                        memcpy(flat + have, stream + fed, nread);
+                        have += nread;
+                        while (have - off >= 2) {
+                            vlen = ((unsigned char)flat[off] << 8) |
+                                    (unsigned char)flat[off + 1];
+                            if (!vlen || have - off < 2 + vlen) {
+                                break;
+                            }
+                            spans[0].size = vlen;
+                            netbuf_mblock_reserve(&mgr, spans);
+                            memcpy(SPAN_BUFFER(spans), flat + off + 2, vlen);
+                            netbuf_mblock_release(&mgr, spans);
+                            off += 2 + vlen;
+                        }
+                        memmove(flat, flat + off, have - off);
+                        have -= off;
+
+                    } else {
+                        nb_IOV iovs[4];
+                        nb_SIZE done = 0;
+                        int kk, niov;
+
+                        niov = netbuf_rdbuf_prepare(&rdbuf, iovs, 4, nread);
+                        for (kk = 0; kk < niov && done < nread; kk++) {
+                            nb_SIZE n = nread - done;
+                            if (n > iovs[kk].iov_len) {
+                                n = iovs[kk].iov_len;
+                            }
+                            memcpy(iovs[kk].iov_base, stream + fed + done, n);
+                            done += n;
+                        }
+                        netbuf_rdbuf_commit(&rdbuf, nread);
+
+                        while (netbuf_rdbuf_peek(&rdbuf, hdr, 2) == 0) {
+                            int nspans;
+                            vlen = (hdr[0] << 8) | hdr[1];
+                            if (!vlen ||
+                                    netbuf_rdbuf_get_size(&rdbuf) < 2 + vlen) {
+                                break;
+                            }
+                            netbuf_rdbuf_consume(&rdbuf, 2);
+                            nspans = netbuf_rdbuf_refspan(&rdbuf, vlen,
+                                                          spans, 2);
+                            while (nspans--) {
+                                netbuf_mblock_release(&mgr, spans + nspans);
+                            }
+                        }
+                    }
+
+                    fed += nread;
+                }
+                netbuf_rdbuf_consume(&rdbuf, netbuf_rdbuf_get_size(&rdbuf));
+            }
+
+            printf("    %s: %.2f GB/s\n", mode ? "rdbuf" : "copy",
+                   (double)RDBUF_STREAM * RDBUF_ITERATIONS /
+                   ((double)(clock() - begin) / CLOCKS_PER_SEC) / 1e9);
+            netbuf_rdbuf_cleanup(&rdbuf);
+            netbuf_cleanup(&mgr);
+        }
+    }
+}
+
+#define SHARED_NMGRS 256
+#define SHARED_ITERATIONS 200
+
+/**
+ * Broadcast a payload to many managers, then flush each one. Compares
+ * copying the payload into every manager's data pool (and releasing the
+ * copy once flushed) against enqueueing a single shared buffer.
+ */
+static void bench_shared(void)
+{
+    static const nb_SIZE sizes[] = { 256, 4096, 65536 };
+    static nb_MGR mgrs[SHARED_NMGRS];
+    static nb_SPAN copies[SHARED_NMGRS];
+    unsigned int sz;
+    int ii;
+
+    for (ii = 0; ii < SHARED_NMGRS; ii++) {
+        netbuf_init(mgrs + ii, NULL);
+    }
+
+    for (sz = 0; sz < sizeof(sizes) / sizeof(*sizes); sz++) {
+        int mode;
+        printf("  %lu byte payload\n", (unsigned long)sizes[sz]);
+
+        for (mode = 0; mode < 2; mode++) {
+            clock_t begin = clock();
+            int jj;
+
+            for (jj = 0; jj < SHARED_ITERATIONS; jj++) {
+                nb_SHARED *shared = netbuf_shared_alloc(NULL, sizes[sz]);
+                nb_IOV iov;
+
+                memset(shared->buf, jj, sizes[sz]);
+                iov.iov_base = shared->buf;
+                iov.iov_len = sizes[sz];
+
+                for (ii = 0; ii < SHARED_NMGRS; ii++) {
+                    if (mode == 0) {
+                        netbuf_enqueue_copy(mgrs + ii, &iov, 1, copies + ii);
+                    } else {
+                        netbuf_enqueue_shared(mgrs + ii, shared);
+                    }
+                }
+                netbuf_shared_unref(shared);
+
+                for (ii = 0; ii < SHARED_NMGRS; ii++) {
+                    nb_IOV iovs[8];
+                    nb_SIZE nb = netbuf_start_flush(mgrs + ii, iovs, 8, NULL);
+                    netbuf_end_flush(mgrs + ii, nb);
+                    if (mode == 0) {
+                        netbuf_mblock_release(mgrs + ii, copies + ii);
+                    }
+                }
+            }
+
+            printf("    %s: %.2fus per broadcast\n", mode ? "shared" : "copy",
+                   (double)(clock() - begin) / CLOCKS_PER_SEC * 1e6
+                   / SHARED_ITERATIONS);
+        }
+    }
+
+    for (ii = 0; ii < SHARED_NMGRS; ii++) {
+        netbuf_cleanup(mgrs + ii);
+    }
+}
+
+static bench_ENTRY benchmarks[] = {
+    { "reserve_release", bench_reserve_release },
+    { "avail_lookup", bench_avail_lookup },
+    { "sendq_flush", bench_sendq_flush },
+    { "ooo_release", bench_ooo_release },
+    { "active_unlink", bench_active_unlink },
+    { "placement", bench_placement },
+    { "first_request", bench_first_request },
+    { "large_copy", bench_large_copy },
+    { "large_spans", bench_large_spans },
+    { "reserve_many", bench_reserve_many },
+    { "release_many", bench_release_many },
+    { "commit_actual", bench_commit_actual },
+    { "writer", bench_writer },
+    { "aligned", bench_aligned },
+    { "enqueue_copy", bench_enqueue_copy },
+    { "hybrid_copy", bench_hybrid_copy },
+    { "flush_fd", bench_flush_fd },
+    { "uring", bench_uring },
+    { "zerocopy", bench_zerocopy },
+    { "rdbuf", bench_rdbuf },
+    { "shared", bench_shared },
+    { NULL, NULL }
+};
+
+/**
+ * Usage: bench [NAME...]
+ * With no arguments, all benchmarks are run.
+ */
+int main(int argc, char **argv)
+{
+    bench_ENTRY *ent;
+
+    for (ent = benchmarks; ent->name; ent++) {
+        clock_t begin;
+        int ii;
+
+        if (argc > 1) {
+            for (ii = 1; ii < argc; ii++) {
+                if (!strcmp(argv[ii], ent->name)) {
+                    break;
+                }
+            }
+            if (ii == argc) {
+                continue;
+            }
+        }
+
+        printf("%s\n", ent->name);
+        begin = clock();
+        ent->run();
+        printf("  %.3fs\n", (double)(clock() - begin) / CLOCKS_PER_SEC);
+    }
     return 0;
 }
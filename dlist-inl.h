@@ -0,0 +1,72 @@
+#include "dlist.h"
+#include <stdlib.h>
+#include <assert.h>
+
+#ifndef INLINE
+#ifdef _MSC_VER
+#define INLINE __inline
+#elif __GNUC__
+#define INLINE __inline__
+#else
+#define INLINE inline
+#endif /* MSC_VER */
+#endif /* !INLINE */
+
+static INLINE void
+dlist_append(dlist_root *list, dlist_node *item)
+{
+    item->next = NULL;
+    item->prev = list->last;
+
+    if (DLIST_IS_EMPTY(list)) {
+        list->first = item;
+    } else {
+        list->last->next = item;
+    }
+    list->last = item;
+}
+
+static INLINE void
+dlist_prepend(dlist_root *list, dlist_node *item)
+{
+    item->prev = NULL;
+    item->next = list->first;
+
+    if (DLIST_IS_EMPTY(list)) {
+        list->last = item;
+    } else {
+        list->first->prev = item;
+    }
+    list->first = item;
+}
+
+/**
+ * Removes an item from the list. The item must be a member of the list.
+ */
+static INLINE void
+dlist_remove(dlist_root *list, dlist_node *item)
+{
+    if (item->prev) {
+        item->prev->next = item->next;
+    } else {
+        assert(list->first == item);
+        list->first = item->next;
+    }
+
+    if (item->next) {
+        item->next->prev = item->prev;
+    } else {
+        assert(list->last == item);
+        list->last = item->prev;
+    }
+
+    item->next = item->prev = NULL;
+}
+
+static INLINE void
+dlist_remove_head(dlist_root *list)
+{
+    if (list->first) {
+        dlist_remove(list, list->first);
+    }
+}
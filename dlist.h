@@ -0,0 +1,47 @@
+#ifndef LCB_DLIST_H
+#define LCB_DLIST_H
+
+/**
+ * Doubly-linked variant of slist. This is used where items must be removed
+ * from the middle of a list without traversing it.
+ */
+
+struct dlist_node_st;
+typedef struct dlist_node_st {
+    struct dlist_node_st *next;
+    struct dlist_node_st *prev;
+} dlist_node;
+
+typedef struct {
+    dlist_node *first;
+    dlist_node *last;
+} dlist_root;
+
+/**
+ * Indicates whether the list is empty or not
+ */
+#define DLIST_IS_EMPTY(list) ((list)->last == NULL)
+
+/**
+ * Iterator for list. As with SLIST_FOREACH, the current item must not be
+ * removed while iterating; use DLIST_FOREACH_SAFE for that.
+ *
+ * @param list the list to iterate
+ * @param pos a local variable to use as the iterator
+ */
+#define DLIST_FOREACH(list, pos) \
+    for (pos = (list)->first; pos; pos = pos->next)
+
+/**
+ * Like DLIST_FOREACH, but allows the current item to be removed.
+ * @param next an additional local variable to hold the next item
+ */
+#define DLIST_FOREACH_SAFE(list, pos, nextpos) \
+    for (pos = (list)->first; \
+            pos && ((nextpos = pos->next), 1); \
+            pos = nextpos)
+
+#define DLIST_ITEM(ptr, type, member) \
+        ((type *) ((char *)(ptr) - offsetof(type, member)))
+
+#endif
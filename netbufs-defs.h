@@ -12,15 +12,18 @@ typedef unsigned int nb_SIZE;
  * data segements allow each individual element to be spaced near the next.
  */
 
-/** How many blocks to preallocate for SNDQ elements, per manager */
+/**
+ * The send queue is a single growable array. Its initial capacity is
+ * NB_SNDQ_CACHEBLOCKS * NB_SNDQ_BASEALLOC entries (rounded up to a power
+ * of two).
+ */
 #define NB_SNDQ_CACHEBLOCKS 4
-/** How many SNDQELEM structures per block */
 #define NB_SNDQ_BASEALLOC 128
 
 
-/** How many dealloc blocks to allocated per MBLOCK */
-#define NB_MBDEALLOC_CACHEBLOCKS 0
-/** Number of dealloc structures per block */
+/** How many unused dealloc queues to keep cached, per pool */
+#define NB_MBDEALLOC_CACHEBLOCKS 4
+/** Initial number of ranges in each dealloc queue */
 #define NB_MBDEALLOC_BASEALLOC 24
 
 
@@ -29,6 +32,134 @@ typedef unsigned int nb_SIZE;
 /** Default data allocation size */
 #define NB_DATA_BASEALLOC 32768
 
+/**
+ * Flags for nb_SETTINGS::prealloc. By default each preallocated block
+ * descriptor receives its own buffer the first time it is used.
+ */
+
+/** Back all data cache blocks with a single allocation made at init time */
+#define NB_PREALLOC_DATA 0x01
+/** Allocate the send queue at init time rather than on first use */
+#define NB_PREALLOC_SNDQ 0x02
+/** Touch every page of the preallocated memory at init time */
+#define NB_PREALLOC_PREFAULT 0x04
+
+/** Default preallocation flags */
+#define NB_PREALLOC 0
+
+/** Maximum number of emptied data blocks to keep for reuse */
+#define NB_DATA_MAXAVAIL 8
+/** Maximum number of bytes in emptied data blocks to keep for reuse */
+#define NB_DATA_MAXAVAILBYTES 1048576
+
+/**
+ * Spans larger than this are given a block of their own, sized exactly for
+ * the span, which is freed as soon as the span is released. 0 disables this,
+ * in which case large spans get a block of basealloc * 2^N bytes.
+ */
+#define NB_DATA_LARGESPAN 0
+
+/**
+ * Data block buffers of at least this many bytes are allocated directly
+ * with mmap() (where available) rather than through the allocator.
+ * 0 disables this.
+ */
+#define NB_DATA_MMAP_THRESHOLD 0
+
+/** Flags for nb_SETTINGS::data_mmap_flags */
+
+/**
+ * Try to map the buffers with explicit huge pages (MAP_HUGETLB). If no huge
+ * pages are available, normal pages are used instead
+ */
+#define NB_MMAP_HUGETLB 0x01
+/** Ask for transparent huge pages (madvise(MADV_HUGEPAGE)) */
+#define NB_MMAP_THP 0x02
+/**
+ * Use MADV_FREE rather than MADV_DONTNEED when trimming mapped buffers, so
+ * the pages are only reclaimed under memory pressure
+ */
+#define NB_MMAP_LAZYFREE 0x04
+
+/** Default flags for mapped data buffers */
+#define NB_DATA_MMAP_FLAGS 0
+
+/**
+ * Buffers of at least this many bytes copied by netbuf_enqueue_copy() are
+ * written with non-temporal stores (where supported), which bypass the
+ * cache. This is faster for copies which do not fit in the cache anyway.
+ * 0 disables this.
+ */
+#define NB_COPY_NTTHRESHOLD (4 * 1024 * 1024)
+
+/**
+ * Buffers smaller than this passed to netbuf_enqueue() are copied into the
+ * data pool (where they may be coalesced with neighbouring data) rather than
+ * referenced. The copies are released once they have been flushed.
+ * 0 disables this.
+ */
+#define NB_COPY_THRESHOLD 0
+
+/**
+ * When zerocopy is enabled (see netbuf_zerocopy_enable()), writes smaller
+ * than this are sent without MSG_ZEROCOPY, as setting up the page pinning
+ * and notification costs more than copying them.
+ */
+#define NB_ZEROCOPY_THRESHOLD 16384
+
+/**
+ * Policies for choosing the block a span is reserved from when the most
+ * recently used block does not have room for it.
+ */
+typedef enum {
+    /** Allocate a new block. Spans are always placed in reservation order */
+    NB_PLACEMENT_LAST = 0,
+
+    /** Try up to data_scanblocks of the most recently activated blocks */
+    NB_PLACEMENT_SCAN,
+
+    /**
+     * Use an index of active blocks by free space to find a block with
+     * enough room in constant time
+     */
+    NB_PLACEMENT_FIT
+} nb_PLACEMENT;
+
+/** Default placement policy for data */
+#define NB_DATA_PLACEMENT NB_PLACEMENT_LAST
+/** Number of blocks to examine for NB_PLACEMENT_SCAN */
+#define NB_DATA_SCANBLOCKS 4
+
+
+/**
+ * Memory allocation callbacks. All memory used by the manager's pools
+ * (blocks, buffers and dealloc queues) is obtained through these.
+ *
+ * If 'alloc' is NULL, malloc() and free() are used. Otherwise both 'alloc'
+ * and 'free' must be set.
+ */
+typedef struct {
+    /** Allocate 'size' bytes. Return NULL on failure */
+    void *(*alloc)(void *ctx, nb_SIZE size);
+
+    /**
+     * Free memory returned by 'alloc'. 'size' is the size which was passed
+     * to 'alloc' for this pointer.
+     */
+    void (*free)(void *ctx, void *ptr, nb_SIZE size);
+
+    /**
+     * Optional. Given the size of a block buffer about to be allocated,
+     * return the size which will actually be usable by the allocator (for
+     * example, the size rounded up to the allocator's size class). Block
+     * buffers are then allocated with that size, so that no slack is wasted.
+     * Values lower than 'size' are ignored.
+     */
+    nb_SIZE (*size_hint)(void *ctx, nb_SIZE size);
+
+    /** Passed as the first argument to the callbacks */
+    void *ctx;
+} nb_ALLOCATOR;
 
 typedef struct {
     nb_SIZE sndq_cacheblocks;
@@ -37,6 +168,18 @@ typedef struct {
     nb_SIZE dea_basealloc;
     nb_SIZE data_cacheblocks;
     nb_SIZE data_basealloc;
+    nb_PLACEMENT data_placement;
+    nb_SIZE data_scanblocks;
+    nb_SIZE data_maxavail;
+    nb_SIZE data_maxavailbytes;
+    nb_SIZE data_largespan;
+    nb_SIZE copy_ntthreshold;
+    nb_SIZE copy_threshold;
+    nb_SIZE zerocopy_threshold;
+    nb_SIZE prealloc;
+    nb_SIZE data_mmap_threshold;
+    nb_SIZE data_mmap_flags;
+    nb_ALLOCATOR allocator;
 } nb_SETTINGS;
 
 #ifndef _WIN32
@@ -81,28 +81,9 @@ struct netbufs_mblock_st;
 struct netbufs_st;
 struct netbufs_mblock_dealloc_queue_st;
 
-/**
- * Small header for larger structures to more efficiently find the block
- * they were allocated in.
- *
- * Note that it is possible to also determine this information by traversing
- * the list of all blocks, but this is naturally less efficient.
- */
-typedef struct {
-    /** The parent block */
-    struct netbufs_mblock_st *parent;
-    /** The allocation offset */
-    nb_SIZE offset;
-} nb_ALLOCINFO;
-
-typedef struct {
-    slist_node slnode;
-    nb_SIZE offset;
-    nb_SIZE size;
-} nb_QDEALLOC;
-
 typedef struct {
-    slist_node slnode;
+    /** Node within the pool's active or available lists */
+    dlist_node dlnode;
 
     /** Start position for data */
     nb_SIZE start;
@@ -158,34 +139,151 @@ typedef struct {
      */
     struct netbufs_mblock_dealloc_queue_st *deallocs;
     struct netbufs_mblock_st *parent;
+
+    /** Node within the pool's fit index (NB_PLACEMENT_FIT only) */
+    dlist_node fitnode;
+
+    /** Fit index class of this block, or NB_MBLOCK_NOFIT */
+    unsigned int fitclass;
+
+    /** NB_MBLOCK_F_* flags */
+    unsigned int flags;
 } nb_MBLOCK;
 
+/** The block's buffer is part of the pool's slab and is never freed alone */
+#define NB_MBLOCK_F_SLAB 0x01
+/** The block's buffer was allocated with mmap() */
+#define NB_MBLOCK_F_MMAP 0x02
+/** The block holds a single large span and is freed along with it */
+#define NB_MBLOCK_F_LARGE 0x04
+
+/**
+ * Small header for larger structures to more efficiently find the block
+ * they were allocated in.
+ *
+ * Note that it is possible to also determine this information by traversing
+ * the list of all blocks, but this is naturally less efficient.
+ */
+typedef struct {
+    /** The parent block */
+    nb_MBLOCK *parent;
+    /** The allocation offset */
+    nb_SIZE offset;
+} nb_ALLOCINFO;
+
+/** A range of a block which was released out of order */
+typedef struct {
+    nb_SIZE offset;
+    nb_SIZE size;
+} nb_QDEALLOC;
+
+/**
+ * Number of size classes for available blocks. Blocks are allocated with
+ * a size of basealloc * 2^N, so class N holds blocks with at least
+ * basealloc << N bytes. The last class holds all larger blocks.
+ */
+#define NB_MBLOCK_NCLASSES 16
+
+/**
+ * Number of classes in the fit index. Class N holds active blocks which can
+ * accommodate a span of 2^N (but not 2^(N+1)) bytes.
+ */
+#define NB_MBLOCK_NFITCLASSES 32
+#define NB_MBLOCK_NOFIT ((unsigned int)-1)
+
 typedef struct netbufs_mblock_st {
     /** Active blocks that have at least one reserved span */
-    slist_root active;
+    dlist_root active;
+
+    /** Available blocks with data, segregated by size class */
+    dlist_root avail[NB_MBLOCK_NCLASSES];
+
+    /** Bitmask of size classes which have available blocks */
+    unsigned int availmask;
+
+    /** Policy for placing spans which do not fit in the last block */
+    nb_PLACEMENT placement;
+
+    /** Number of blocks to try for NB_PLACEMENT_SCAN */
+    unsigned int scanblocks;
 
-    /** Available blocks with data */
-    slist_root avail;
+    /** Active blocks indexed by free space (NB_PLACEMENT_FIT only) */
+    dlist_root fit[NB_MBLOCK_NFITCLASSES];
+
+    /** Bitmask of non-empty fit classes */
+    unsigned int fitmask;
+
+    /** Number of lookups within the available blocks */
+    unsigned int avail_lookups;
+
+    /** Number of size classes and blocks inspected during lookups */
+    unsigned int avail_probes;
 
     /** Allocation size */
     nb_SIZE basealloc;
 
-    /** Maximum number of non-cached blocks */
+    /** Minimum buffer size to allocate with mmap(), or 0 */
+    nb_SIZE mmap_threshold;
+
+    /** Spans larger than this are placed in their own block, unless 0 */
+    nb_SIZE largespan;
+
+    /** Blocks holding a single large span */
+    dlist_root large;
+
+    /** Maximum number of emptied blocks to keep in the available lists */
     unsigned int maxblocks;
 
-    /** Current number of non-cached blocks */
+    /** Current number of blocks in the available lists */
     unsigned int curblocks;
 
+    /** Maximum number of bytes to keep in the available lists */
+    nb_SIZE maxbytes;
+
+    /** Current number of bytes in the available lists */
+    nb_SIZE curbytes;
+
+    /** Unused dealloc queues, kept for reuse by other blocks */
+    slist_root deacache;
+
+    /** Number of queues in deacache */
+    unsigned int ndeacache;
+
     nb_MBLOCK *cacheblocks;
     nb_SIZE ncacheblocks;
 
+    /**
+     * If set, a single buffer backing all the cache blocks. These blocks are
+     * always kept in the available lists when empty.
+     */
+    char *slab;
+
     struct netbufs_st *mgr;
 } nb_MBPOOL;
 
+/**
+ * Tracks the ranges of a block which have been released out of order. The
+ * ranges are sorted by offset, and adjacent ranges are merged, so that
+ * once the block's start reaches a range, all of it may be reclaimed at once.
+ *
+ * Ranges never include the block's start or cursor; a release at either end
+ * of the used region is applied directly to the block.
+ */
 typedef struct netbufs_mblock_dealloc_queue_st {
-    slist_root pending;
-    nb_SIZE min_offset;
-    nb_MBPOOL qpool;
+    /** Used when the queue is cached inside the pool */
+    slist_node slnode;
+
+    /** Sorted array of released ranges */
+    nb_QDEALLOC *ranges;
+
+    /** Number of ranges in use */
+    nb_SIZE nranges;
+
+    /** Number of ranges allocated */
+    nb_SIZE nalloc;
+
+    /** Total size of all the ranges */
+    nb_SIZE nbytes;
 } nb_DEALLOC_QUEUE;
 
 #ifdef __cplusplus
@@ -0,0 +1,283 @@
+/* for syscall() in strict ANSI builds */
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "netbufs-uring.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define LOAD_ACQUIRE(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static int
+sys_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+sys_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                unsigned int flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+static void *
+map_ring(int fd, size_t size, off_t offset)
+{
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, offset);
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+int
+netbuf_uring_init(nb_URING *ring, unsigned int entries)
+{
+    struct io_uring_params params;
+    unsigned int ii;
+    char *sq, *cq;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = sys_uring_setup(entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->sq_mapsize = params.sq_off.array + params.sq_entries * sizeof(__u32);
+    ring->cq_mapsize = params.cq_off.cqes +
+            params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_mapsize > ring->sq_mapsize) {
+            ring->sq_mapsize = ring->cq_mapsize;
+        }
+        ring->cq_mapsize = 0;
+    }
+
+    ring->sq_map = map_ring(ring->fd, ring->sq_mapsize, IORING_OFF_SQ_RING);
+    if (!ring->sq_map) {
+        goto GT_ERROR;
+    }
+    if (ring->cq_mapsize) {
+        ring->cq_map = map_ring(ring->fd, ring->cq_mapsize, IORING_OFF_CQ_RING);
+        if (!ring->cq_map) {
+            goto GT_ERROR;
+        }
+    } else {
+        ring->cq_map = ring->sq_map;
+    }
+
+    ring->sqes_mapsize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = map_ring(ring->fd, ring->sqes_mapsize, IORING_OFF_SQES);
+    if (!ring->sqes) {
+        goto GT_ERROR;
+    }
+
+    sq = ring->sq_map;
+    ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+
+    cq = ring->cq_map;
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = cq + params.cq_off.cqes;
+
+    /** The completion queue is at least as large, so it cannot overflow */
+    ring->nops = params.sq_entries;
+    ring->ops = calloc(ring->nops, sizeof(*ring->ops));
+    ring->freeops = malloc(sizeof(*ring->freeops) * ring->nops);
+    if (!ring->ops || !ring->freeops) {
+        errno = ENOMEM;
+        goto GT_ERROR;
+    }
+    for (ii = 0; ii < ring->nops; ii++) {
+        ring->freeops[ii] = ring->nops - ii - 1;
+    }
+    ring->nfree = ring->nops;
+    return 0;
+
+    GT_ERROR:
+    {
+        int err = errno;
+        netbuf_uring_cleanup(ring);
+        errno = err;
+        return -1;
+    }
+}
+
+void
+netbuf_uring_cleanup(nb_URING *ring)
+{
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_mapsize);
+    }
+    if (ring->cq_map && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_mapsize);
+    }
+    if (ring->sq_map) {
+        munmap(ring->sq_map, ring->sq_mapsize);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    free(ring->ops);
+    free(ring->freeops);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+void
+netbuf_uring_conn_init(nb_URINGCONN *conn, nb_MGR *mgr, int fd)
+{
+    memset(conn, 0, sizeof(*conn));
+    conn->mgr = mgr;
+    conn->fd = fd;
+}
+
+int
+netbuf_uring_flush(nb_URING *ring, nb_URINGCONN *conn)
+{
+    struct io_uring_sqe *sqe;
+    nb_URINGOP *op;
+    unsigned int tail, opix;
+    int niov = 0;
+
+    if (conn->busy || !netbuf_get_size(conn->mgr)) {
+        return 0;
+    }
+
+    tail = *ring->sq_tail;
+    if (!ring->nfree || tail - LOAD_ACQUIRE(ring->sq_head) > ring->sq_mask) {
+        return -1;
+    }
+
+    opix = ring->freeops[ring->nfree - 1];
+    op = ring->ops + opix;
+    if (!netbuf_start_flush(conn->mgr, op->iovs, NB_URING_NIOV, &niov)) {
+        return 0;
+    }
+    ring->nfree--;
+    op->conn = conn;
+    conn->busy = 1;
+
+    sqe = (struct io_uring_sqe *)ring->sqes + (tail & ring->sq_mask);
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = conn->fd;
+    sqe->user_data = opix;
+    if (conn->use_writev) {
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->addr = (unsigned long)op->iovs;
+        sqe->len = niov;
+        sqe->off = (__u64)-1;
+    } else if (niov == 1) {
+        /** Avoids copying in the message header */
+        sqe->opcode = IORING_OP_SEND;
+        sqe->addr = (unsigned long)op->iovs[0].iov_base;
+        sqe->len = op->iovs[0].iov_len;
+        sqe->msg_flags = conn->flags | MSG_NOSIGNAL;
+    } else {
+        memset(&op->msg, 0, sizeof(op->msg));
+        op->msg.msg_iov = (struct iovec *)op->iovs;
+        op->msg.msg_iovlen = niov;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->addr = (unsigned long)&op->msg;
+        sqe->len = 1;
+        sqe->msg_flags = conn->flags | MSG_NOSIGNAL;
+    }
+
+    ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+    STORE_RELEASE(ring->sq_tail, tail + 1);
+    ring->nqueued++;
+    return 1;
+}
+
+int
+netbuf_uring_submit(nb_URING *ring, unsigned int wait_nr)
+{
+    int rv;
+
+    if (!ring->nqueued && !wait_nr) {
+        return 0;
+    }
+
+    do {
+        rv = sys_uring_enter(ring->fd, ring->nqueued, wait_nr,
+                             wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    } while (rv < 0 && errno == EINTR);
+
+    if (rv < 0) {
+        return -1;
+    }
+    ring->nqueued -= rv;
+    return rv;
+}
+
+/** Applies a completed write to the connection's manager */
+static void
+complete_op(nb_URINGCONN *conn, int result)
+{
+    nb_SIZE nflushed = result > 0 ? (nb_SIZE)result : 0;
+    nb_SIZE inflight = netbuf_get_inflight(conn->mgr);
+
+    if (conn->getsize) {
+        netbuf_end_flush2(conn->mgr, nflushed, conn->getsize, conn->lloff,
+                          conn->arg);
+    } else {
+        netbuf_end_flush(conn->mgr, nflushed);
+    }
+
+    if (nflushed != inflight) {
+        netbuf_rewind_flush(conn->mgr);
+    }
+    conn->busy = 0;
+}
+
+unsigned int
+netbuf_uring_complete(nb_URING *ring, nb_uring_done_fn callback)
+{
+    unsigned int head = *ring->cq_head, ncompleted = 0;
+
+    while (head != LOAD_ACQUIRE(ring->cq_tail)) {
+        struct io_uring_cqe *cqe =
+                (struct io_uring_cqe *)ring->cqes + (head & ring->cq_mask);
+        unsigned int opix = (unsigned int)cqe->user_data;
+        nb_URINGCONN *conn = ring->ops[opix].conn;
+        int result = cqe->res;
+
+        head++;
+        STORE_RELEASE(ring->cq_head, head);
+        ring->freeops[ring->nfree++] = opix;
+        ncompleted++;
+
+        complete_op(conn, result);
+        if (result == -ENOTSOCK && !conn->use_writev) {
+            /** Not a socket; retry with writev on the next flush */
+            conn->use_writev = 1;
+            continue;
+        }
+        if (result == -EINTR || result == -EAGAIN) {
+            result = 0;
+        }
+        if (callback) {
+            callback(conn, result);
+        }
+    }
+
+    return ncompleted;
+}
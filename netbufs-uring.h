@@ -0,0 +1,157 @@
+#ifndef NETBUFS_URING_H
+#define NETBUFS_URING_H
+
+#include <sys/socket.h>
+#include "netbufs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * io_uring flush backend (Linux only).
+ *
+ * Writes the send queues of many managers with a single io_uring_enter()
+ * call, rather than one writev() per connection. Each connection has at most
+ * one write in flight; its completion is passed to netbuf_end_flush() (or
+ * netbuf_end_flush2()) on the connection's manager.
+ *
+ * A typical event loop iteration looks like this:
+ *
+ * for each connection with data: netbuf_uring_flush(&ring, conn);
+ * netbuf_uring_submit(&ring, 0);
+ * ...
+ * netbuf_uring_complete(&ring, on_written);
+ *
+ * The ring is driven with raw system calls, so liburing is not needed.
+ */
+
+/** Maximum number of IOVs written by a single operation */
+#define NB_URING_NIOV 32
+
+struct netbufs_uring_conn_st;
+
+/**
+ * Invoked for every completed write, after the manager has been updated.
+ * @param result the number of bytes written, or a negative errno value
+ */
+typedef void (*nb_uring_done_fn)(struct netbufs_uring_conn_st *conn,
+                                 int result);
+
+typedef struct netbufs_uring_conn_st {
+    nb_MGR *mgr;
+    int fd;
+
+    /** Additional flags for sendmsg(), e.g. MSG_MORE */
+    int flags;
+
+    /**
+     * If set, completions are passed to netbuf_end_flush2() with these
+     * arguments, rather than to netbuf_end_flush()
+     */
+    nb_getsize_fn getsize;
+    nb_SIZE lloff;
+    void *arg;
+
+    /** User data */
+    void *data;
+
+    /** Whether a write is in flight */
+    unsigned int busy;
+
+    /** Whether the descriptor is not a socket, and writev is used instead */
+    unsigned int use_writev;
+} nb_URINGCONN;
+
+/** A single write in flight */
+typedef struct {
+    nb_URINGCONN *conn;
+    struct msghdr msg;
+    nb_IOV iovs[NB_URING_NIOV];
+} nb_URINGOP;
+
+typedef struct {
+    int fd;
+
+    /** Submission queue, as mapped from the kernel */
+    void *sq_map;
+    size_t sq_mapsize;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int *sq_array;
+    void *sqes;
+    size_t sqes_mapsize;
+
+    /** Completion queue, as mapped from the kernel */
+    void *cq_map;
+    size_t cq_mapsize;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    void *cqes;
+
+    /** Number of entries prepared but not yet submitted */
+    unsigned int nqueued;
+
+    /** Operations, indexed by the entries' user_data */
+    nb_URINGOP *ops;
+    unsigned int nops;
+
+    /** Stack of unused operation indexes */
+    unsigned int *freeops;
+    unsigned int nfree;
+} nb_URING;
+
+/**
+ * Creates the ring.
+ * @param entries the maximum number of writes in flight
+ * @return 0 on success, or -1 with errno set (e.g. if io_uring is not
+ *         supported by the kernel)
+ */
+int
+netbuf_uring_init(nb_URING *ring, unsigned int entries);
+
+/**
+ * Destroys the ring. No writes may be in flight.
+ */
+void
+netbuf_uring_cleanup(nb_URING *ring);
+
+void
+netbuf_uring_conn_init(nb_URINGCONN *conn, nb_MGR *mgr, int fd);
+
+/**
+ * Prepares a write of the connection's send queue. The write is performed
+ * by the next netbuf_uring_submit().
+ *
+ * @return 1 if a write was prepared, 0 if there is nothing to write or a
+ *         write is already in flight, or -1 if the ring is full
+ */
+int
+netbuf_uring_flush(nb_URING *ring, nb_URINGCONN *conn);
+
+/**
+ * Submits the prepared writes.
+ * @param wait_nr the number of completions to wait for
+ * @return the number of writes submitted, or -1 with errno set
+ */
+int
+netbuf_uring_submit(nb_URING *ring, unsigned int wait_nr);
+
+/**
+ * Processes the completed writes. Each completion is passed to the
+ * connection's manager, and then to 'callback' if not NULL.
+ *
+ * After a short write, the unwritten data is returned again by the next
+ * netbuf_uring_flush(). After an error, the data remains queued.
+ *
+ * @return the number of completions processed
+ */
+unsigned int
+netbuf_uring_complete(nb_URING *ring, nb_uring_done_fn callback);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -2,15 +2,59 @@
 #define WIN32_LEAN_AND_MEAN
 /* for ULONG */
 #include <windows.h>
+#else
+/* for MAP_ANONYMOUS and madvise() in strict ANSI builds */
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
 #endif
 
 #include <stdio.h>
 #include <stddef.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <unistd.h>
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#define NETBUFS_NO_MSG_NOSIGNAL
+#endif
+#if defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#define NETBUFS_HAVE_ZEROCOPY
+#endif
+#if defined(MAP_ANON) && !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifdef MAP_ANONYMOUS
+#define NETBUFS_HAVE_MMAP
+#endif
+#endif
+
 #include "netbufs.h"
 #include "slist-inl.h"
+#include "dlist-inl.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define NETBUFS_HAVE_SSE2
+#endif
+
+/** Maximum number of IOVs accepted by writev() and friends */
+#if defined(IOV_MAX)
+#define NETBUFS_IOV_MAX IOV_MAX
+#elif defined(UIO_MAXIOV)
+#define NETBUFS_IOV_MAX UIO_MAXIOV
+#else
+#define NETBUFS_IOV_MAX 1024
+#endif
 
 #ifndef lcb_assert
 #include <assert.h>
@@ -28,33 +72,216 @@
 #define BLOCK_IS_EMPTY(block) ((block)->start == (block)->cursor)
 
 #define FIRST_BLOCK(pool) \
-    (SLIST_ITEM((pool)->active.first, nb_MBLOCK, slnode))
+    (DLIST_ITEM((pool)->active.first, nb_MBLOCK, dlnode))
 
-#define LAST_BLOCK(mgr) \
-    (SLIST_ITEM((mgr)->active_blocks.last, nb_BLOCKHDR, slnode))
+#define LAST_BLOCK(pool) \
+    (DLIST_ITEM((pool)->active.last, nb_MBLOCK, dlnode))
 
 #define NEXT_BLOCK(block) \
-    (SLIST_ITEM((block)->slnode.next, nb_BLOCKHDR, slnode))
+    (DLIST_ITEM((block)->dlnode.next, nb_MBLOCK, dlnode))
 
-#define BLOCK_HAS_DEALLOCS(block) \
-    ((block)->deallocs && SLIST_IS_EMPTY(&(block)->deallocs->pending))
+#define BLOCK_HAS_DEALLOCS(block) ((block)->deallocs != NULL)
 
+/** Number of bytes to skip from ptr for it to be aligned to align */
+#define ALIGN_PAD(ptr, align) \
+    (((align) - ((size_t)(ptr) & ((align) - 1))) & ((align) - 1))
 
-#define MALLOC_WITH_STATS(p, size, mgr) \
-    p = malloc(size); \
-    mgr->total_allocs++; \
-    mgr->total_bytes += size;
+/** Size of explicit huge pages, for NB_MMAP_HUGETLB */
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
 
-#define CALLOC_WITH_STATS(p, n, elemsz, mgr) \
-    p = calloc(n, elemsz); \
-    mgr->total_allocs++; \
-    mgr->total_bytes += (n) * (elemsz);
 
 /** Static forward decls */
 static void mblock_release_data(nb_MBPOOL*,nb_MBLOCK*,nb_SIZE,nb_SIZE);
-static void mblock_release_ptr(nb_MBPOOL*,char*,nb_SIZE);
-static void mblock_init(nb_MBPOOL*);
+static void mblock_deactivate(nb_MBPOOL*,nb_MBLOCK*);
+static void mblock_init(nb_MBPOOL*,int,int);
 static void mblock_cleanup(nb_MBPOOL*);
+static void ooo_free_queue(nb_MBPOOL*,nb_DEALLOC_QUEUE*);
+static void ooo_queue_dealoc(nb_MBPOOL*,nb_MBLOCK*,nb_SIZE,nb_SIZE);
+
+/******************************************************************************
+ ******************************************************************************
+ ** Memory Allocation                                                        **
+ ******************************************************************************
+ ******************************************************************************/
+static void *
+libc_alloc(void *ctx, nb_SIZE size)
+{
+    (void)ctx;
+    return malloc(size);
+}
+
+static void
+libc_free(void *ctx, void *ptr, nb_SIZE size)
+{
+    (void)ctx;
+    (void)size;
+    free(ptr);
+}
+
+/**
+ * Allocates memory through the manager's allocator, accounting for it in the
+ * manager's statistics.
+ */
+static void *
+mgr_alloc(nb_MGR *mgr, nb_SIZE size)
+{
+    void *ret = mgr->settings.allocator.alloc(mgr->settings.allocator.ctx, size);
+    if (ret) {
+        mgr->total_allocs++;
+        mgr->total_bytes += size;
+    }
+    return ret;
+}
+
+/** Like mgr_alloc(), but zeroes the memory */
+static void *
+mgr_calloc(nb_MGR *mgr, nb_SIZE size)
+{
+    void *ret = mgr_alloc(mgr, size);
+    if (ret) {
+        memset(ret, 0, size);
+    }
+    return ret;
+}
+
+/** Frees memory obtained via mgr_alloc(). 'size' must be the allocated size */
+static void
+mgr_free(nb_MGR *mgr, void *ptr, nb_SIZE size)
+{
+    mgr->settings.allocator.free(mgr->settings.allocator.ctx, ptr, size);
+    mgr->total_bytes -= size;
+}
+
+/** Gets the size to actually allocate for a block buffer of 'size' bytes */
+static nb_SIZE
+mgr_size_hint(const nb_MGR *mgr, nb_SIZE size)
+{
+    nb_SIZE ret;
+    if (!mgr->settings.allocator.size_hint) {
+        return size;
+    }
+    ret = mgr->settings.allocator.size_hint(mgr->settings.allocator.ctx, size);
+    return ret > size ? ret : size;
+}
+
+#ifdef NETBUFS_HAVE_MMAP
+/** Rounds 'size' up to a multiple of 'align' (a power of two), or returns 0 */
+static nb_SIZE
+round_up_pow2(nb_SIZE size, nb_SIZE align)
+{
+    nb_SIZE ret = (size + align - 1) & ~(align - 1);
+    return ret < size ? 0 : ret;
+}
+
+/**
+ * Maps a buffer of at least 'size' bytes for the block, according to the
+ * data_mmap_flags setting. The block's nalloc is set to the mapped length.
+ *
+ * @return 0 on success, -1 if the buffer must be allocated normally
+ */
+static int
+mblock_map_buffer(nb_MBPOOL *pool, nb_MBLOCK *block, nb_SIZE size)
+{
+    nb_MGR *mgr = pool->mgr;
+    nb_SIZE flags = mgr->settings.data_mmap_flags;
+    nb_SIZE len = 0;
+    void *addr = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if ((flags & NB_MMAP_HUGETLB) &&
+            (len = round_up_pow2(size, HUGEPAGE_SIZE)) != 0) {
+        addr = mmap(NULL, len, PROT_READ|PROT_WRITE,
+                    MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+    }
+#endif
+
+    if (addr == MAP_FAILED) {
+        /** No huge pages reserved (or not supported); use normal pages */
+        len = round_up_pow2(size, (nb_SIZE)sysconf(_SC_PAGESIZE));
+        if (!len) {
+            return -1;
+        }
+        addr = mmap(NULL, len, PROT_READ|PROT_WRITE,
+                    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) {
+            return -1;
+        }
+#ifdef MADV_HUGEPAGE
+        if (flags & NB_MMAP_THP) {
+            madvise(addr, len, MADV_HUGEPAGE);
+        }
+#endif
+    }
+
+    block->root = addr;
+    block->nalloc = len;
+    block->flags |= NB_MBLOCK_F_MMAP;
+    mgr->total_allocs++;
+    mgr->total_bytes += len;
+    return 0;
+}
+
+static void
+mblock_unmap_buffer(nb_MBPOOL *pool, nb_MBLOCK *block)
+{
+    munmap(block->root, block->nalloc);
+    pool->mgr->total_bytes -= block->nalloc;
+    block->root = NULL;
+    block->flags &= ~NB_MBLOCK_F_MMAP;
+}
+
+/**
+ * Releases the pages of an unused mapped buffer, while keeping the mapping
+ * itself so that the block may be reused.
+ */
+static void
+mblock_advise_free(nb_MBPOOL *pool, nb_MBLOCK *block)
+{
+    int advice = MADV_DONTNEED;
+#ifdef MADV_FREE
+    if (pool->mgr->settings.data_mmap_flags & NB_MMAP_LAZYFREE) {
+        advice = MADV_FREE;
+    }
+#endif
+    madvise(block->root, block->nalloc, advice);
+}
+#endif /* NETBUFS_HAVE_MMAP */
+
+/**
+ * Copies a buffer using non-temporal stores, which do not pollute the cache
+ * with the destination.
+ */
+static void
+copy_nontemporal(char *dst, const char *src, size_t len)
+{
+#ifdef NETBUFS_HAVE_SSE2
+    size_t head = ALIGN_PAD(dst, 16);
+
+    if (head > len) {
+        head = len;
+    }
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    len -= head;
+
+    while (len >= 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)src);
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+        _mm_stream_si128((__m128i *)dst, a);
+        _mm_stream_si128((__m128i *)(dst + 16), b);
+        _mm_stream_si128((__m128i *)(dst + 32), c);
+        _mm_stream_si128((__m128i *)(dst + 48), d);
+        dst += 64;
+        src += 64;
+        len -= 64;
+    }
+    _mm_sfence();
+#endif
+    memcpy(dst, src, len);
+}
 
 /******************************************************************************
  ******************************************************************************
@@ -72,6 +299,26 @@ mblock_is_standalone(nb_MBLOCK *block)
     return block->parent == NULL;
 }
 
+/**
+ * Allocates the buffer for a block, mapping it if it is large enough.
+ * The block's nalloc is set to the usable size, which may be larger than
+ * 'size'.
+ */
+static int
+mblock_alloc_buffer(nb_MBPOOL *pool, nb_MBLOCK *block, nb_SIZE size)
+{
+#ifdef NETBUFS_HAVE_MMAP
+    if (pool->mmap_threshold && size >= pool->mmap_threshold &&
+            mblock_map_buffer(pool, block, size) == 0) {
+        return 0;
+    }
+#endif
+
+    block->nalloc = mgr_size_hint(pool->mgr, size);
+    block->root = mgr_alloc(pool->mgr, block->nalloc);
+    return block->root ? 0 : -1;
+}
+
 /**
  * Allocates a new block with at least the given capacity and places it
  * inside the active list.
@@ -90,7 +337,7 @@ alloc_new_block(nb_MBPOOL *pool, nb_SIZE capacity)
     }
 
     if (!ret) {
-        CALLOC_WITH_STATS(ret, 1, sizeof(*ret), pool->mgr);
+        ret = mgr_calloc(pool->mgr, sizeof(*ret));
     }
 
     if (!ret) {
@@ -105,11 +352,12 @@ alloc_new_block(nb_MBPOOL *pool, nb_SIZE capacity)
 
     ret->wrap = 0;
     ret->cursor = 0;
-    MALLOC_WITH_STATS(ret->root, ret->nalloc, pool->mgr);
 
-    if (!ret->root) {
+    if (mblock_alloc_buffer(pool, ret, ret->nalloc) != 0) {
         if (mblock_is_standalone(ret)) {
-            free(ret);
+            mgr_free(pool->mgr, ret, sizeof(*ret));
+        } else {
+            ret->nalloc = 0;
         }
         return NULL;
     }
@@ -117,30 +365,268 @@ alloc_new_block(nb_MBPOOL *pool, nb_SIZE capacity)
     return ret;
 }
 
+/**
+ * Frees a block's buffer. The block must not be in any list. Standalone
+ * blocks are freed as well, while preallocated blocks are marked as unused
+ * so that alloc_new_block() may pick them up again.
+ */
+static void
+mblock_free_block(nb_MBPOOL *pool, nb_MBLOCK *block)
+{
+    if (block->flags & NB_MBLOCK_F_SLAB) {
+        /** Freed along with the slab */
+        block->root = NULL;
+    }
+
+#ifdef NETBUFS_HAVE_MMAP
+    if (block->flags & NB_MBLOCK_F_MMAP) {
+        mblock_unmap_buffer(pool, block);
+    }
+#endif
+
+    if (block->root) {
+        mgr_free(pool->mgr, block->root, block->nalloc);
+        block->root = NULL;
+    }
+
+    if (block->deallocs) {
+        ooo_free_queue(pool, block->deallocs);
+        block->deallocs = NULL;
+    }
+
+    if (mblock_is_standalone(block)) {
+        mgr_free(pool->mgr, block, sizeof(*block));
+    } else {
+        block->nalloc = 0;
+    }
+}
+
+/**
+ * Gets the size class for a given size. If round_up is true, this returns the
+ * smallest class whose blocks are all guaranteed to hold 'size' bytes;
+ * otherwise it returns the largest class whose minimum is not greater than
+ * 'size'.
+ */
+static unsigned int
+mblock_size_class(const nb_MBPOOL *pool, nb_SIZE size, int round_up)
+{
+    unsigned int cls = 0;
+    nb_SIZE cur = pool->basealloc;
+
+    while (cls < NB_MBLOCK_NCLASSES - 1) {
+        nb_SIZE next = cur * 2;
+
+        if (round_up) {
+            if (cur >= size) {
+                break;
+            }
+        } else if (next > size) {
+            break;
+        }
+
+        if (next <= cur) {
+            /** Overflow; everything else lives in the last class */
+            return NB_MBLOCK_NCLASSES - 1;
+        }
+
+        cur = next;
+        cls++;
+    }
+
+    return cls;
+}
+
+/**
+ * Places an empty block inside the available list for its size class
+ */
+static void
+mblock_avail_push(nb_MBPOOL *pool, nb_MBLOCK *block)
+{
+    unsigned int cls = mblock_size_class(pool, block->nalloc, 0);
+    dlist_append(&pool->avail[cls], &block->dlnode);
+    pool->availmask |= 1U << cls;
+}
+
 /**
  * Finds an available block within the available list. The block will have
  * room for at least capacity bytes.
+ *
+ * The smallest non-empty size class guaranteed to satisfy the capacity is
+ * used. Only the last (unbounded) class needs to be scanned.
  */
 static nb_MBLOCK*
 find_free_block(nb_MBPOOL *pool, nb_SIZE capacity)
 {
-    slist_iterator iter;
-    SLIST_ITERFOR(&pool->avail, &iter) {
-        nb_MBLOCK *cur = SLIST_ITEM(iter.cur, nb_MBLOCK, slnode);
-        if (cur->nalloc >= capacity) {
-            slist_iter_remove(&pool->avail, &iter);
+    unsigned int cls;
+    nb_MBLOCK *ret = NULL;
+
+    pool->avail_lookups++;
+
+    for (cls = mblock_size_class(pool, capacity, 1);
+            cls < NB_MBLOCK_NCLASSES; cls++) {
+
+        dlist_root *list = &pool->avail[cls];
 
-            if (mblock_is_standalone(cur)) {
-                pool->curblocks--;
+        if (!(pool->availmask & (1U << cls))) {
+            continue;
+        }
+
+        pool->avail_probes++;
+
+        if (cls != NB_MBLOCK_NCLASSES - 1) {
+            ret = DLIST_ITEM(list->first, nb_MBLOCK, dlnode);
+            dlist_remove_head(list);
+
+        } else {
+            dlist_node *ll;
+            DLIST_FOREACH(list, ll) {
+                nb_MBLOCK *cur = DLIST_ITEM(ll, nb_MBLOCK, dlnode);
+                pool->avail_probes++;
+                if (cur->nalloc >= capacity) {
+                    dlist_remove(list, ll);
+                    ret = cur;
+                    break;
+                }
             }
+        }
+
+        if (DLIST_IS_EMPTY(list)) {
+            pool->availmask &= ~(1U << cls);
+        }
 
-            return cur;
+        if (ret) {
+            break;
         }
     }
 
+    if (ret && !(ret->flags & NB_MBLOCK_F_SLAB)) {
+        pool->curblocks--;
+        pool->curbytes -= ret->nalloc;
+    }
+
+    return ret;
+}
+
+/**
+ * Gets the size of the largest span which may be reserved from an active
+ * block, allowing for wrapping.
+ */
+static nb_SIZE
+mblock_get_room(const nb_MBLOCK *block)
+{
+    if (block->cursor == block->wrap) {
+        nb_SIZE tail = block->nalloc - block->cursor;
+        return tail > block->start ? tail : block->start;
+    }
+    return block->start - block->cursor;
+}
+
+/** Floor of log2(size), for size > 0 */
+static unsigned int
+mblock_log2(nb_SIZE size)
+{
+    unsigned int ret = 0;
+    while (size >>= 1) {
+        ret++;
+    }
+    return ret;
+}
+
+static void
+mblock_fit_remove(nb_MBPOOL *pool, nb_MBLOCK *block)
+{
+    if (block->fitclass == NB_MBLOCK_NOFIT) {
+        return;
+    }
+
+    dlist_remove(&pool->fit[block->fitclass], &block->fitnode);
+    if (DLIST_IS_EMPTY(&pool->fit[block->fitclass])) {
+        pool->fitmask &= ~(1U << block->fitclass);
+    }
+    block->fitclass = NB_MBLOCK_NOFIT;
+}
+
+/**
+ * Re-indexes an active block after its free space has changed. This is a
+ * no-op unless the pool uses NB_PLACEMENT_FIT. Large blocks belong to a
+ * single span, so they are never indexed.
+ */
+static void
+mblock_fit_update(nb_MBPOOL *pool, nb_MBLOCK *block)
+{
+    nb_SIZE room;
+    unsigned int cls;
+
+    if (pool->placement != NB_PLACEMENT_FIT ||
+            (block->flags & NB_MBLOCK_F_LARGE)) {
+        return;
+    }
+
+    room = mblock_get_room(block);
+    cls = room ? mblock_log2(room) : NB_MBLOCK_NOFIT;
+    if (cls == block->fitclass) {
+        return;
+    }
+
+    mblock_fit_remove(pool, block);
+    if (cls != NB_MBLOCK_NOFIT) {
+        dlist_append(&pool->fit[cls], &block->fitnode);
+        pool->fitmask |= 1U << cls;
+        block->fitclass = cls;
+    }
+}
+
+/**
+ * Finds an active block which is guaranteed to have room for a span of the
+ * given size, using the fit index.
+ */
+static nb_MBLOCK *
+mblock_fit_find(nb_MBPOOL *pool, nb_SIZE size)
+{
+    unsigned int cls = mblock_log2(size);
+
+    if (size & (size - 1)) {
+        /** Blocks in the floor class may be too small */
+        cls++;
+    }
+
+    for (; cls < NB_MBLOCK_NFITCLASSES; cls++) {
+        if (pool->fitmask & (1U << cls)) {
+            return DLIST_ITEM(pool->fit[cls].first, nb_MBLOCK, fitnode);
+        }
+    }
     return NULL;
 }
 
+/**
+ * Allocates a block sized for the given span alone, and places it inside the
+ * large list. Such blocks are never shared with other spans, and are freed
+ * as soon as the span is released.
+ */
+static int
+reserve_large_block(nb_MBPOOL *pool, nb_SPAN *span)
+{
+    nb_MBLOCK *block = mgr_calloc(pool->mgr, sizeof(*block));
+
+    if (!block) {
+        return -1;
+    }
+
+    if (mblock_alloc_buffer(pool, block, span->size) != 0) {
+        mgr_free(pool->mgr, block, sizeof(*block));
+        return -1;
+    }
+
+    block->flags |= NB_MBLOCK_F_LARGE;
+    block->fitclass = NB_MBLOCK_NOFIT;
+    block->wrap = block->cursor = span->size;
+    dlist_append(&pool->large, &block->dlnode);
+
+    span->parent = block;
+    span->offset = 0;
+    return 0;
+}
+
 /**
  * Find a new block for the given span and initialize it for a reserved size
  * correlating to the span.
@@ -167,8 +653,10 @@ reserve_empty_block(nb_MBPOOL *pool, nb_SPAN *span)
     block->cursor = span->size;
 
     block->deallocs = NULL;
+    block->fitclass = NB_MBLOCK_NOFIT;
 
-    slist_append(&pool->active, &block->slnode);
+    dlist_append(&pool->active, &block->dlnode);
+    mblock_fit_update(pool, block);
     return 0;
 }
 
@@ -181,10 +669,6 @@ reserve_empty_block(nb_MBPOOL *pool, nb_SPAN *span)
 static int
 reserve_active_block(nb_MBLOCK *block, nb_SPAN *span)
 {
-    if (BLOCK_HAS_DEALLOCS(block)) {
-        return -1;
-    }
-
     if (block->cursor > block->start) {
         if (block->nalloc - block->cursor >= span->size) {
             span->offset = block->cursor;
@@ -213,88 +697,395 @@ reserve_active_block(nb_MBLOCK *block, nb_SPAN *span)
     }
 }
 
+/**
+ * Attempt to reserve space from an active block other than the last one,
+ * according to the pool's placement policy.
+ */
+static nb_MBLOCK *
+reserve_placed_block(nb_MBPOOL *pool, nb_SPAN *span)
+{
+    nb_MBLOCK *block = NULL;
+
+    if (pool->placement == NB_PLACEMENT_SCAN) {
+        dlist_node *ll = pool->active.last->prev;
+        unsigned int ii;
+
+        for (ii = 0; ll && ii < pool->scanblocks; ii++, ll = ll->prev) {
+            block = DLIST_ITEM(ll, nb_MBLOCK, dlnode);
+            if (reserve_active_block(block, span) == 0) {
+                return block;
+            }
+        }
+        return NULL;
+
+    } else if (pool->placement == NB_PLACEMENT_FIT) {
+        block = mblock_fit_find(pool, span->size);
+        if (block && reserve_active_block(block, span) == 0) {
+            return block;
+        }
+    }
+
+    return NULL;
+}
+
 static int
-mblock_reserve_data(nb_MBPOOL *pool, nb_SPAN *span)
+mblock_reserve_data(nb_MBPOOL *pool, nb_SPAN *span, int flags)
 {
     nb_MBLOCK *block;
-    int rv;
 
 #ifdef NETBUFS_LIBC_PROXY
-    block = malloc(sizeof(*block) + span->size);
+    block = mgr_alloc(pool->mgr, sizeof(*block) + span->size);
+    if (!block) {
+        return -1;
+    }
     block->root = ((char *)block) + sizeof(*block);
+    block->nalloc = sizeof(*block) + span->size;
     span->parent = block;
     span->offset = 0;
+    (void)flags;
     return 0;
 #endif
 
-    if (SLIST_IS_EMPTY(&pool->active)) {
-        return reserve_empty_block(pool, span);
+    if (pool->largespan && span->size > pool->largespan) {
+        return reserve_large_block(pool, span);
+    }
 
-    } else {
-        block = SLIST_ITEM(pool->active.last, nb_MBLOCK, slnode);
-        rv = reserve_active_block(block, span);
+    if (DLIST_IS_EMPTY(&pool->active)) {
+        return reserve_empty_block(pool, span);
+    }
 
-        if (rv != 0) {
+    block = LAST_BLOCK(pool);
+    if (reserve_active_block(block, span) != 0) {
+        block = NULL;
+        if (!(flags & NETBUF_RESERVE_INORDER)) {
+            block = reserve_placed_block(pool, span);
+        }
+        if (!block) {
             return reserve_empty_block(pool, span);
         }
-
-        span->parent = block;
-        return rv;
     }
+
+    span->parent = block;
+    mblock_fit_update(pool, block);
+    return 0;
 }
 
-/******************************************************************************
- ******************************************************************************
- ** Out-Of-Order Deallocation Functions                                      **
+/**
+ * Like reserve_active_block(), but the span's buffer is aligned to 'align'
+ * bytes. The padding in front of the span is queued as released, so that it
+ * is reclaimed along with the surrounding spans.
+ */
+static int
+reserve_active_aligned(nb_MBPOOL *pool, nb_MBLOCK *block, nb_SPAN *span,
+                       nb_SIZE align)
+{
+    nb_SIZE pad, padstart;
+
+    if (block->cursor > block->start) {
+        pad = ALIGN_PAD(block->root + block->cursor, align);
+        if (block->nalloc - block->cursor >= span->size &&
+                block->nalloc - block->cursor - span->size >= pad) {
+            padstart = block->cursor;
+            span->offset = block->cursor + pad;
+            block->cursor = span->offset + span->size;
+            block->wrap = block->cursor;
+
+        } else {
+            /** Wrap around the wrap */
+            pad = ALIGN_PAD(block->root, align);
+            if (block->start < span->size || block->start - span->size < pad) {
+                return -1;
+            }
+            padstart = 0;
+            span->offset = pad;
+            block->cursor = pad + span->size;
+        }
+
+    } else {
+        /* Already wrapped */
+        pad = ALIGN_PAD(block->root + block->cursor, align);
+        if (block->start - block->cursor < span->size ||
+                block->start - block->cursor - span->size < pad) {
+            return -1;
+        }
+        padstart = block->cursor;
+        span->offset = block->cursor + pad;
+        block->cursor = span->offset + span->size;
+    }
+
+    if (pad) {
+        ooo_queue_dealoc(pool, block, padstart, pad);
+    }
+    return 0;
+}
+
+/**
+ * Reserves a span whose buffer is aligned to 'align' bytes, which must be a
+ * power of two. The span is placed in the last block, or in a new one.
+ */
+static int
+mblock_reserve_aligned(nb_MBPOOL *pool, nb_SPAN *span, nb_SIZE align)
+{
+    nb_MBLOCK *block;
+    nb_SPAN padded;
+    nb_SIZE pad;
+
+    if (align & (align - 1)) {
+        return -1;
+    }
+    if (align <= 1) {
+        return mblock_reserve_data(pool, span, 0);
+    }
+
+    padded.size = span->size + align - 1;
+    if (padded.size < span->size) {
+        return -1;
+    }
+
+#ifdef NETBUFS_LIBC_PROXY
+    if (mblock_reserve_data(pool, &padded, 0) != 0) {
+        return -1;
+    }
+    span->parent = padded.parent;
+    span->offset = ALIGN_PAD(padded.parent->root, align);
+    return 0;
+#endif
+
+    if (pool->largespan && span->size > pool->largespan) {
+        if (reserve_large_block(pool, &padded) != 0) {
+            return -1;
+        }
+        block = padded.parent;
+
+    } else if (!DLIST_IS_EMPTY(&pool->active) &&
+            reserve_active_aligned(pool, LAST_BLOCK(pool), span, align) == 0) {
+        span->parent = LAST_BLOCK(pool);
+        mblock_fit_update(pool, span->parent);
+        return 0;
+
+    } else if (reserve_empty_block(pool, &padded) != 0) {
+        return -1;
+
+    } else {
+        block = padded.parent;
+    }
+
+    /** A new block; skip the padding by moving its start */
+    pad = ALIGN_PAD(block->root, align);
+    block->start = pad;
+    block->wrap = block->cursor = pad + span->size;
+    span->parent = block;
+    span->offset = pad;
+    mblock_fit_update(pool, block);
+    return 0;
+}
+
+/******************************************************************************
+ ******************************************************************************
+ ** Out-Of-Order Deallocation Functions                                      **
  ******************************************************************************
  ******************************************************************************/
+/**
+ * Returns the index of the first range whose offset is not lower than
+ * 'offset'
+ */
+static nb_SIZE
+ooo_lower_bound(const nb_DEALLOC_QUEUE *queue, nb_SIZE offset)
+{
+    nb_SIZE lo = 0, hi = queue->nranges;
+    while (lo < hi) {
+        nb_SIZE mid = lo + (hi - lo) / 2;
+        if (queue->ranges[mid].offset < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
 static void
-ooo_queue_dealoc(nb_MGR *mgr, nb_MBLOCK *block, nb_SPAN *span)
+ooo_remove_range(nb_DEALLOC_QUEUE *queue, nb_SIZE ix)
 {
-    nb_QDEALLOC *qd;
-    nb_DEALLOC_QUEUE *queue;
-    nb_SPAN qespan;
+    queue->nranges--;
+    memmove(queue->ranges + ix, queue->ranges + ix + 1,
+            sizeof(*queue->ranges) * (queue->nranges - ix));
+}
 
-    if (!block->deallocs) {
-        CALLOC_WITH_STATS(queue, 1, sizeof(*queue), mgr);
-        queue->qpool.basealloc = sizeof(*qd) * mgr->settings.dea_basealloc;
-        queue->qpool.ncacheblocks = mgr->settings.dea_cacheblocks;
-        queue->qpool.mgr = mgr;
+static nb_DEALLOC_QUEUE *
+ooo_get_queue(nb_MBPOOL *pool)
+{
+    nb_DEALLOC_QUEUE *queue;
+    nb_MGR *mgr = pool->mgr;
 
-        mblock_init(&queue->qpool);
-        block->deallocs = queue;
+    if (!SLIST_IS_EMPTY(&pool->deacache)) {
+        queue = SLIST_ITEM(pool->deacache.first, nb_DEALLOC_QUEUE, slnode);
+        slist_remove_head(&pool->deacache);
+        pool->ndeacache--;
+        return queue;
     }
 
-    queue = block->deallocs;
-    qespan.size = sizeof(*qd);
-    mblock_reserve_data(&queue->qpool, &qespan);
+    queue = mgr_calloc(mgr, sizeof(*queue));
+    if (!queue) {
+        return NULL;
+    }
 
-    qd = (nb_QDEALLOC *)SPAN_BUFFER(&qespan);
-    qd->offset = span->offset;
-    qd->size = span->size;
-    if (queue->min_offset > qd->offset) {
-        queue->min_offset = qd->offset;
+    queue->nalloc = mgr->settings.dea_basealloc ? mgr->settings.dea_basealloc : 1;
+    queue->ranges = mgr_alloc(mgr, sizeof(*queue->ranges) * queue->nalloc);
+    if (!queue->ranges) {
+        mgr_free(mgr, queue, sizeof(*queue));
+        return NULL;
     }
-    slist_append(&queue->pending, &qd->slnode);
+    return queue;
 }
 
 static void
-ooo_apply_dealloc(nb_MBLOCK *block, nb_SIZE offset)
+ooo_free_queue(nb_MBPOOL *pool, nb_DEALLOC_QUEUE *queue)
+{
+    mgr_free(pool->mgr, queue->ranges, sizeof(*queue->ranges) * queue->nalloc);
+    mgr_free(pool->mgr, queue, sizeof(*queue));
+}
+
+/**
+ * Detaches the (now empty) dealloc queue from the block, caching it if
+ * possible.
+ */
+static void
+ooo_put_queue(nb_MBPOOL *pool, nb_MBLOCK *block)
 {
-    nb_SIZE min_next = -1;
-    slist_iterator iter;
     nb_DEALLOC_QUEUE *queue = block->deallocs;
 
-    SLIST_ITERFOR(&queue->pending, &iter) {
-        nb_QDEALLOC *cur = SLIST_ITEM(iter.cur, nb_QDEALLOC, slnode);
-        if (cur->offset == offset) {
-            slist_iter_remove(&block->deallocs->pending, &iter);
-            mblock_release_ptr(&queue->qpool, (char *)cur, sizeof(*cur));
-        } else if (cur->offset < min_next) {
-            min_next = cur->offset;
+    lcb_assert(queue->nranges == 0);
+    block->deallocs = NULL;
+
+    if (pool->ndeacache < pool->mgr->settings.dea_cacheblocks) {
+        slist_append(&pool->deacache, &queue->slnode);
+        pool->ndeacache++;
+    } else {
+        ooo_free_queue(pool, queue);
+    }
+}
+
+/**
+ * Records an out-of-order release of the given range, merging it with any
+ * adjacent released ranges.
+ */
+static void
+ooo_queue_dealoc(nb_MBPOOL *pool, nb_MBLOCK *block, nb_SIZE offset,
+                 nb_SIZE size)
+{
+    nb_DEALLOC_QUEUE *queue;
+    nb_QDEALLOC *prev = NULL, *next = NULL;
+    nb_SIZE ix;
+
+    if (!block->deallocs) {
+        if ((block->deallocs = ooo_get_queue(pool)) == NULL) {
+            /** Nothing else we can do; the range stays in use */
+            return;
+        }
+    }
+
+    queue = block->deallocs;
+    queue->nbytes += size;
+    ix = ooo_lower_bound(queue, offset);
+
+    if (ix > 0 && queue->ranges[ix-1].offset + queue->ranges[ix-1].size == offset) {
+        prev = queue->ranges + ix - 1;
+    }
+    if (ix < queue->nranges && offset + size == queue->ranges[ix].offset) {
+        next = queue->ranges + ix;
+    }
+
+    if (prev && next) {
+        prev->size += size + next->size;
+        ooo_remove_range(queue, ix);
+        return;
+
+    } else if (prev) {
+        prev->size += size;
+        return;
+
+    } else if (next) {
+        next->offset = offset;
+        next->size += size;
+        return;
+    }
+
+    if (queue->nranges == queue->nalloc) {
+        nb_QDEALLOC *ranges;
+        nb_SIZE nalloc = queue->nalloc * 2;
+        ranges = mgr_alloc(pool->mgr, sizeof(*ranges) * nalloc);
+        if (!ranges) {
+            queue->nbytes -= size;
+            return;
         }
+        memcpy(ranges, queue->ranges, sizeof(*ranges) * queue->nranges);
+        mgr_free(pool->mgr, queue->ranges, sizeof(*ranges) * queue->nalloc);
+        queue->ranges = ranges;
+        queue->nalloc = nalloc;
+    }
+
+    memmove(queue->ranges + ix + 1, queue->ranges + ix,
+            sizeof(*queue->ranges) * (queue->nranges - ix));
+    queue->ranges[ix].offset = offset;
+    queue->ranges[ix].size = size;
+    queue->nranges++;
+}
+
+/**
+ * Removes the range beginning at the block's start, if any.
+ * @return the size of the range, or 0 if there is none.
+ */
+static nb_SIZE
+ooo_take_start(nb_MBLOCK *block)
+{
+    nb_DEALLOC_QUEUE *queue = block->deallocs;
+    nb_SIZE ix, size;
+
+    if (!queue) {
+        return 0;
+    }
+
+    ix = ooo_lower_bound(queue, block->start);
+    if (ix == queue->nranges || queue->ranges[ix].offset != block->start) {
+        return 0;
+    }
+
+    size = queue->ranges[ix].size;
+    ooo_remove_range(queue, ix);
+    queue->nbytes -= size;
+    return size;
+}
+
+/**
+ * Removes the range ending at the block's cursor, if any.
+ * @return the size of the range, or 0 if there is none.
+ */
+static nb_SIZE
+ooo_take_cursor(nb_MBLOCK *block)
+{
+    nb_DEALLOC_QUEUE *queue = block->deallocs;
+    nb_QDEALLOC *range;
+    nb_SIZE ix, size;
+
+    if (!queue) {
+        return 0;
+    }
+
+    ix = ooo_lower_bound(queue, block->cursor);
+    if (!ix) {
+        return 0;
+    }
+
+    range = queue->ranges + ix - 1;
+    if (range->offset + range->size != block->cursor) {
+        return 0;
     }
-    queue->min_offset = min_next;
+
+    size = range->size;
+    ooo_remove_range(queue, ix - 1);
+    queue->nbytes -= size;
+    return size;
 }
 
 
@@ -302,390 +1093,1821 @@ static INLINE void
 mblock_release_data(nb_MBPOOL *pool,
                     nb_MBLOCK *block, nb_SIZE size, nb_SIZE offset)
 {
+    if (block->flags & NB_MBLOCK_F_LARGE) {
+        dlist_remove(&pool->large, &block->dlnode);
+        mblock_fit_remove(pool, block);
+        mblock_free_block(pool, block);
+        return;
+    }
+
     if (offset == block->start) {
         /** Removing from the beginning */
-        block->start += size;
+        do {
+            block->start += size;
 
-        if (block->deallocs && block->deallocs->min_offset == block->start) {
-            ooo_apply_dealloc(block, block->start);
-        }
-
-        if (!BLOCK_IS_EMPTY(block) && block->start == block->wrap) {
-            block->wrap = block->cursor;
-            block->start = 0;
-        }
+            if (!BLOCK_IS_EMPTY(block) && block->start == block->wrap) {
+                block->wrap = block->cursor;
+                block->start = 0;
+            }
+        } while (!BLOCK_IS_EMPTY(block) && (size = ooo_take_start(block)));
 
     } else if (offset + size == block->cursor) {
         /** Removing from the end */
-        if (block->cursor == block->wrap) {
-            /** Single region, no wrap */
-            block->cursor -= size;
-            block->wrap -= size;
-
-        } else {
-            block->cursor -= size;
-            if (!block->cursor) {
-                /** End has reached around */
-                block->cursor = block->wrap;
+        do {
+            if (block->cursor == block->wrap) {
+                /** Single region, no wrap */
+                block->cursor -= size;
+                block->wrap -= size;
+
+            } else {
+                block->cursor -= size;
+                if (!block->cursor) {
+                    /** End has reached around */
+                    block->cursor = block->wrap;
+                }
             }
-        }
+        } while (!BLOCK_IS_EMPTY(block) && (size = ooo_take_cursor(block)));
 
     } else {
-        nb_SPAN span = { block, offset, size };
-        ooo_queue_dealoc(pool->mgr, block, &span);
+        ooo_queue_dealoc(pool, block, offset, size);
         return;
     }
 
+    if (block->deallocs && !block->deallocs->nranges) {
+        ooo_put_queue(pool, block);
+    }
+
     if (!BLOCK_IS_EMPTY(block)) {
+        mblock_fit_update(pool, block);
         return;
     }
 
-    {
-        slist_iterator iter;
-        SLIST_ITERFOR(&pool->active, &iter) {
-            if (&block->slnode == iter.cur) {
-                slist_iter_remove(&pool->active, &iter);
-                break;
-            }
-        }
-    }
+    mblock_deactivate(pool, block);
+}
+
+/**
+ * Removes an empty block from the active list, and either keeps it for reuse
+ * or frees it.
+ */
+static void
+mblock_deactivate(nb_MBPOOL *pool, nb_MBLOCK *block)
+{
+    dlist_remove(&pool->active, &block->dlnode);
+    mblock_fit_remove(pool, block);
 
-    if (pool->curblocks < pool->maxblocks) {
-        slist_append(&pool->avail, &block->slnode);
+    if (block->flags & NB_MBLOCK_F_SLAB) {
+        mblock_avail_push(pool, block);
+
+    } else if (pool->curblocks < pool->maxblocks &&
+            pool->maxbytes - pool->curbytes >= block->nalloc) {
+        mblock_avail_push(pool, block);
         pool->curblocks++;
+        pool->curbytes += block->nalloc;
 
     } else {
-        free(block->root);
-        pool->mgr->total_bytes -= block->nalloc;
-        block->root = NULL;
-        if (mblock_is_standalone(block)) {
-            pool->mgr->total_bytes -= sizeof(*block);
-            free(block);
+        mblock_free_block(pool, block);
+    }
+}
+
+static int
+mblock_get_next_size(const nb_MBPOOL *pool, int allow_wrap)
+{
+    nb_MBLOCK *block;
+    if (DLIST_IS_EMPTY(&pool->active)) {
+        return 0;
+    }
+
+    block = LAST_BLOCK(pool);
+
+    if (!block->start) {
+        /** Plain 'ole buffer */
+        return block->nalloc - block->cursor;
+    }
+
+    if (block->cursor != block->wrap) {
+        /** Already in second region */
+        return block->start - block->cursor;
+    }
+
+    if (allow_wrap) {
+        return MINIMUM(block->nalloc - block->wrap, block->start);
+    }
+
+    return block->nalloc - block->wrap;
+}
+
+static void
+free_blocklist(nb_MBPOOL *pool, dlist_root *list)
+{
+    dlist_node *ll, *next;
+    DLIST_FOREACH_SAFE(list, ll, next) {
+        dlist_remove(list, ll);
+        mblock_free_block(pool, DLIST_ITEM(ll, nb_MBLOCK, dlnode));
+    }
+}
+
+
+static void
+mblock_cleanup(nb_MBPOOL *pool)
+{
+    unsigned int ii;
+
+    free_blocklist(pool, &pool->active);
+    free_blocklist(pool, &pool->large);
+    for (ii = 0; ii < NB_MBLOCK_NCLASSES; ii++) {
+        free_blocklist(pool, &pool->avail[ii]);
+    }
+    pool->availmask = 0;
+    pool->curblocks = 0;
+    pool->curbytes = 0;
+
+    while (!SLIST_IS_EMPTY(&pool->deacache)) {
+        nb_DEALLOC_QUEUE *queue =
+                SLIST_ITEM(pool->deacache.first, nb_DEALLOC_QUEUE, slnode);
+        slist_remove_head(&pool->deacache);
+        ooo_free_queue(pool, queue);
+    }
+    pool->ndeacache = 0;
+
+    if (pool->slab) {
+        mgr_free(pool->mgr, pool->slab, pool->basealloc * pool->ncacheblocks);
+        pool->slab = NULL;
+    }
+
+    if (pool->cacheblocks) {
+        mgr_free(pool->mgr, pool->cacheblocks,
+                 sizeof(*pool->cacheblocks) * pool->ncacheblocks);
+        pool->cacheblocks = NULL;
+    }
+}
+
+/**
+ * Frees (or, for mapped buffers, releases the pages of) the emptied blocks
+ * kept in the available lists. Slab blocks are left alone.
+ */
+static void
+mblock_trim(nb_MBPOOL *pool)
+{
+    unsigned int ii;
+
+    for (ii = 0; ii < NB_MBLOCK_NCLASSES; ii++) {
+        dlist_root *list = &pool->avail[ii];
+        dlist_node *ll, *next;
+
+        DLIST_FOREACH_SAFE(list, ll, next) {
+            nb_MBLOCK *block = DLIST_ITEM(ll, nb_MBLOCK, dlnode);
+
+            if (block->flags & NB_MBLOCK_F_SLAB) {
+                continue;
+            }
+
+#ifdef NETBUFS_HAVE_MMAP
+            if (block->flags & NB_MBLOCK_F_MMAP) {
+                mblock_advise_free(pool, block);
+                continue;
+            }
+#endif
+
+            dlist_remove(list, ll);
+            pool->curblocks--;
+            pool->curbytes -= block->nalloc;
+            mblock_free_block(pool, block);
+        }
+
+        if (DLIST_IS_EMPTY(list)) {
+            pool->availmask &= ~(1U << ii);
         }
     }
 }
 
+/**
+ * Initializes the pool's cache blocks.
+ *
+ * @param use_slab whether to allocate the buffers for all the cache blocks
+ *        up front, as a single allocation. The blocks are then placed in the
+ *        available lists.
+ * @param prefault whether to touch all the pages of the slab
+ */
+static void
+mblock_init(nb_MBPOOL *pool, int use_slab, int prefault)
+{
+    unsigned int ii;
+    if (!pool->ncacheblocks) {
+        return;
+    }
+
+    pool->cacheblocks = mgr_calloc(pool->mgr,
+                                   sizeof(*pool->cacheblocks) * pool->ncacheblocks);
+    if (!pool->cacheblocks) {
+        pool->ncacheblocks = 0;
+        return;
+    }
+
+    for (ii = 0; ii < pool->ncacheblocks; ii++) {
+        pool->cacheblocks[ii].parent = pool;
+    }
+
+    if (!use_slab) {
+        return;
+    }
+
+    pool->slab = mgr_alloc(pool->mgr, pool->basealloc * pool->ncacheblocks);
+    if (!pool->slab) {
+        return;
+    }
+
+    if (prefault) {
+        memset(pool->slab, 0, (size_t)pool->basealloc * pool->ncacheblocks);
+    }
+
+    for (ii = 0; ii < pool->ncacheblocks; ii++) {
+        nb_MBLOCK *block = pool->cacheblocks + ii;
+        block->root = pool->slab + (size_t)pool->basealloc * ii;
+        block->nalloc = pool->basealloc;
+        block->flags = NB_MBLOCK_F_SLAB;
+        mblock_avail_push(pool, block);
+    }
+}
+
+int
+netbuf_mblock_reserve(nb_MGR *mgr, nb_SPAN *span)
+{
+    return mblock_reserve_data(&mgr->datapool, span, 0);
+}
+
+int
+netbuf_mblock_reserve2(nb_MGR *mgr, nb_SPAN *span, int flags)
+{
+    return mblock_reserve_data(&mgr->datapool, span, flags);
+}
+
+int
+netbuf_mblock_reserve_aligned(nb_MGR *mgr, nb_SPAN *span, nb_SIZE align)
+{
+    return mblock_reserve_aligned(&mgr->datapool, span, align);
+}
+
+int
+netbuf_mblock_reserve_many(nb_MGR *mgr, nb_SPAN *spans, unsigned int nspans)
+{
+    nb_MBPOOL *pool = &mgr->datapool;
+    nb_SPAN whole;
+    unsigned int ii;
+
+    whole.size = 0;
+    for (ii = 0; ii < nspans; ii++) {
+        if (whole.size + spans[ii].size < whole.size) {
+            whole.size = 0;
+            break;
+        }
+        whole.size += spans[ii].size;
+    }
+
+#ifndef NETBUFS_LIBC_PROXY
+    /**
+     * Reserve everything as one span and divide it up. A large block is
+     * freed along with any of its spans, so it cannot be shared.
+     */
+    if (whole.size && (!pool->largespan || whole.size <= pool->largespan) &&
+            mblock_reserve_data(pool, &whole, 0) == 0) {
+        nb_SIZE offset = whole.offset;
+        for (ii = 0; ii < nspans; ii++) {
+            spans[ii].parent = whole.parent;
+            spans[ii].offset = offset;
+            offset += spans[ii].size;
+        }
+        return 0;
+    }
+#endif
+
+    for (ii = 0; ii < nspans; ii++) {
+        if (mblock_reserve_data(pool, spans + ii, 0) != 0) {
+            /** Roll back, newest first, so each release is at the cursor */
+            while (ii--) {
+                netbuf_mblock_release(mgr, spans + ii);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Moves the span to a new reservation of 'size' bytes, copying as much of
+ * its contents as fits.
+ */
+static int
+mblock_relocate(nb_MGR *mgr, nb_SPAN *span, nb_SIZE size)
+{
+    nb_SPAN newspan;
+
+    newspan.size = size;
+    if (mblock_reserve_data(&mgr->datapool, &newspan, 0) != 0) {
+        return -1;
+    }
+
+    memcpy(SPAN_BUFFER(&newspan), SPAN_BUFFER(span), MINIMUM(size, span->size));
+    netbuf_mblock_release(mgr, span);
+    *span = newspan;
+    return 0;
+}
+
+/**
+ * Grows the span to 'size' bytes if it is the last span of its block and the
+ * block has room for it.
+ * @return 0 if the span was grown, nonzero otherwise
+ */
+static int
+mblock_extend_inplace(nb_MBPOOL *pool, nb_SPAN *span, nb_SIZE size)
+{
+#ifdef NETBUFS_LIBC_PROXY
+    (void)pool;
+    (void)span;
+    (void)size;
+    return -1;
+#else
+    nb_MBLOCK *block = span->parent;
+    nb_SIZE delta = size - span->size;
+
+    if (span->offset + span->size != block->cursor) {
+        return -1;
+    }
+
+    if (block->cursor == block->wrap) {
+        if (block->nalloc - block->cursor < delta) {
+            return -1;
+        }
+        block->cursor += delta;
+        block->wrap = block->cursor;
+
+    } else {
+        if (block->start - block->cursor < delta) {
+            return -1;
+        }
+        block->cursor += delta;
+    }
+
+    span->size = size;
+    mblock_fit_update(pool, block);
+    return 0;
+#endif
+}
+
+int
+netbuf_mblock_extend(nb_MGR *mgr, nb_SPAN *span, nb_SIZE size)
+{
+    if (size <= span->size) {
+        return 0;
+    }
+
+    if (mblock_extend_inplace(&mgr->datapool, span, size) == 0) {
+        return 0;
+    }
+
+    return mblock_relocate(mgr, span, size);
+}
+
+void
+netbuf_mblock_truncate(nb_MGR *mgr, nb_SPAN *span, nb_SIZE size)
+{
+    nb_MBLOCK *block = span->parent;
+
+    if (size >= span->size) {
+        return;
+    }
+
+    if (!size) {
+        netbuf_mblock_release(mgr, span);
+        span->size = 0;
+        return;
+    }
+
+#ifdef NETBUFS_LIBC_PROXY
+    /** The allocation size must stay known; make a smaller one */
+    mblock_relocate(mgr, span, size);
+    (void)block;
+#else
+    if (block->flags & NB_MBLOCK_F_LARGE) {
+        /** The whole block is freed along with the span */
+        block->cursor = block->wrap = span->offset + size;
+    } else {
+        mblock_release_data(&mgr->datapool, block, span->size - size,
+                            span->offset + size);
+    }
+    span->size = size;
+#endif
+}
+
+/******************************************************************************
+ ******************************************************************************
+ ** Informational Routines                                                   **
+ ******************************************************************************
+ ******************************************************************************/
+nb_SIZE
+netbuf_mblock_get_next_size(const nb_MGR *mgr, int allow_wrap)
+{
+    return mblock_get_next_size(&mgr->datapool, allow_wrap);
+}
+
+unsigned int
+netbuf_get_niov(nb_MGR *mgr)
+{
+    return mgr->sendq.count;
+}
+
+nb_SIZE
+netbuf_get_size(const nb_MGR *mgr)
+{
+    return mgr->sendq.enqueued - mgr->sendq.flushed;
+}
+
+nb_SIZE
+netbuf_get_inflight(const nb_MGR *mgr)
+{
+    return mgr->sendq.requested - mgr->sendq.flushed;
+}
+
+nb_SIZE
+netbuf_get_flushed(const nb_MGR *mgr)
+{
+    return mgr->sendq.flushed;
+}
+
+/******************************************************************************
+ ******************************************************************************
+ ** Flush Routines                                                           **
+ ******************************************************************************
+ ******************************************************************************/
+/** Entry 'ix' of the send queue, counting from the head */
+#define SENDQ_AT(q, ix) ((q)->ring + (((q)->head + (ix)) & ((q)->nalloc - 1)))
+
+/**
+ * Grows the send queue's array to 'nalloc' entries, which must be a power
+ * of two. The pending entries are moved to the start of the new array.
+ */
+static int
+sendq_resize(nb_MGR *mgr, unsigned int nalloc)
+{
+    nb_SENDQ *q = &mgr->sendq;
+    nb_IOV *ring = mgr_alloc(mgr, sizeof(*ring) * nalloc);
+    if (!ring) {
+        return -1;
+    }
+
+    if (q->count) {
+        unsigned int nfirst = MINIMUM(q->count, q->nalloc - q->head);
+        memcpy(ring, q->ring + q->head, sizeof(*ring) * nfirst);
+        memcpy(ring + nfirst, q->ring, sizeof(*ring) * (q->count - nfirst));
+    }
+    if (q->ring) {
+        mgr_free(mgr, q->ring, sizeof(*ring) * q->nalloc);
+    }
+
+    q->ring = ring;
+    q->head = 0;
+    q->nalloc = nalloc;
+    return 0;
+}
+
+/** Initial capacity of the send queue */
+static unsigned int
+sendq_initial_size(const nb_MGR *mgr)
+{
+    nb_SIZE want = mgr->settings.sndq_cacheblocks *
+            mgr->settings.sndq_basealloc;
+    unsigned int nalloc = 16;
+    while (nalloc < want) {
+        nalloc *= 2;
+    }
+    return nalloc;
+}
+
+/**
+ * Appends a buffer to the pending list, extending the last element if the
+ * buffer directly follows it.
+ * @return 0 if successful, -1 if the queue could not be grown
+ */
+static int
+sendq_append(nb_MGR *mgr, const nb_IOV *bufinfo)
+{
+    nb_SENDQ *q = &mgr->sendq;
+    nb_IOV *last;
+
+    if (q->count) {
+        last = SENDQ_AT(q, q->count - 1);
+        if ((char *)last->iov_base + last->iov_len == bufinfo->iov_base) {
+            last->iov_len += bufinfo->iov_len;
+            q->enqueued += bufinfo->iov_len;
+            return 0;
+        }
+    }
+
+    if (q->count == q->nalloc &&
+            sendq_resize(mgr, q->nalloc ? q->nalloc * 2 :
+                         sendq_initial_size(mgr)) != 0) {
+        return -1;
+    }
+
+    *SENDQ_AT(q, q->count) = *bufinfo;
+    q->count++;
+    q->enqueued += bufinfo->iov_len;
+    return 0;
+}
+
+#define OWNED_AT(q, ix) ((q)->owned + (((q)->owned_head + (ix)) % (q)->owned_nalloc))
+
+/** Whether stream position 'pos' has been reached by 'cur' */
+#define POS_REACHED(cur, pos) ((int)((cur) - (pos)) >= 0)
+
+#define ZC_AT(q, ix) ((q)->zc + (((q)->zc_head + (ix)) % (q)->zc_nalloc))
+
+/** Stream position before which the kernel no longer references any data */
+#define SENDQ_SAFE_POS(q) ((q)->nzc ? ZC_AT(q, 0)->start : (q)->flushed)
+
+/** Makes room for one more owned span */
+static int
+sendq_grow_owned(nb_MGR *mgr)
+{
+    nb_SENDQ *q = &mgr->sendq;
+    unsigned int ii, nalloc = q->owned_nalloc ? q->owned_nalloc * 2 : 16;
+    nb_SNDQOWNED *arr;
+
+    if (q->nowned != q->owned_nalloc) {
+        return 0;
+    }
+
+    arr = mgr_alloc(mgr, sizeof(*arr) * nalloc);
+    if (!arr) {
+        return -1;
+    }
+    for (ii = 0; ii < q->nowned; ii++) {
+        arr[ii] = *OWNED_AT(q, ii);
+    }
+    if (q->owned) {
+        mgr_free(mgr, q->owned, sizeof(*arr) * q->owned_nalloc);
+    }
+    q->owned = arr;
+    q->owned_head = 0;
+    q->owned_nalloc = nalloc;
+    return 0;
+}
+
+/**
+ * Copies a small buffer into a span owned by the send queue, and enqueues
+ * the copy. The copy is appended to the last owned span if that is at the
+ * end of the queue, so that consecutive copies share a single IOV.
+ *
+ * @return 0 if the buffer was copied, -1 otherwise
+ */
+static int
+sendq_copy(nb_MGR *mgr, const nb_IOV *bufinfo)
+{
+    nb_SENDQ *q = &mgr->sendq;
+    nb_MBPOOL *pool = &mgr->datapool;
+    nb_SIZE len = bufinfo->iov_len;
+    nb_SNDQOWNED *owned = NULL;
+    nb_IOV iov;
+
+    if (q->nowned) {
+        owned = OWNED_AT(q, q->nowned - 1);
+        if (owned->end != q->enqueued || owned->shared ||
+                mblock_extend_inplace(pool, &owned->span,
+                                      owned->span.size + len) != 0) {
+            owned = NULL;
+        }
+    }
+
+    if (owned) {
+        iov.iov_base = (char *)SPAN_BUFFER(&owned->span) +
+                owned->span.size - len;
+        iov.iov_len = len;
+        memcpy(iov.iov_base, bufinfo->iov_base, len);
+        if (sendq_append(mgr, &iov) != 0) {
+            netbuf_mblock_truncate(mgr, &owned->span, owned->span.size - len);
+            return -1;
+        }
+
+    } else {
+        nb_SPAN span;
+
+        if (sendq_grow_owned(mgr) != 0) {
+            return -1;
+        }
+
+        span.size = len;
+        if (mblock_reserve_data(pool, &span, NETBUF_RESERVE_INORDER) != 0) {
+            return -1;
+        }
+        iov.iov_base = SPAN_BUFFER(&span);
+        iov.iov_len = len;
+        memcpy(iov.iov_base, bufinfo->iov_base, len);
+        if (sendq_append(mgr, &iov) != 0) {
+            netbuf_mblock_release(mgr, &span);
+            return -1;
+        }
+
+        owned = OWNED_AT(q, q->nowned);
+        owned->span = span;
+        owned->shared = NULL;
+        q->nowned++;
+    }
+
+    owned->end = q->enqueued;
+    return 0;
+}
+
+/**
+ * Releases the owned spans which have been flushed completely, and are no
+ * longer referenced by the kernel
+ */
+static void
+sendq_release_owned(nb_MGR *mgr, int all)
+{
+    nb_SENDQ *q = &mgr->sendq;
+    nb_SIZE safe = SENDQ_SAFE_POS(q);
+
+    while (q->nowned) {
+        nb_SNDQOWNED *owned = OWNED_AT(q, 0);
+        if (!all && !POS_REACHED(safe, owned->end)) {
+            break;
+        }
+        if (owned->shared) {
+            netbuf_shared_unref(owned->shared);
+        } else {
+            netbuf_mblock_release(mgr, &owned->span);
+        }
+        q->owned_head = (q->owned_head + 1) % q->owned_nalloc;
+        q->nowned--;
+    }
+}
+
+/**
+ * Releases the deferred spans whose preceding data has been flushed
+ * completely, and is no longer referenced by the kernel
+ */
+static void
+sendq_release_deferred(nb_MGR *mgr)
+{
+    nb_SIZE safe = SENDQ_SAFE_POS(&mgr->sendq);
+    unsigned int nready = 0;
+
+    /** Positions are recorded in order */
+    while (nready < mgr->ndeferred &&
+            POS_REACHED(safe, mgr->deferred_end[nready])) {
+        nready++;
+    }
+    if (!nready) {
+        return;
+    }
+
+    netbuf_mblock_release_many(mgr, mgr->deferred, nready);
+    mgr->ndeferred -= nready;
+    memmove(mgr->deferred, mgr->deferred + nready,
+            sizeof(*mgr->deferred) * mgr->ndeferred);
+    memmove(mgr->deferred_end, mgr->deferred_end + nready,
+            sizeof(*mgr->deferred_end) * mgr->ndeferred);
+}
+
+void
+netbuf_enqueue(nb_MGR *mgr, const nb_IOV *bufinfo)
+{
+    int rv;
+
+    if (bufinfo->iov_len < mgr->settings.copy_threshold &&
+            sendq_copy(mgr, bufinfo) == 0) {
+        return;
+    }
+    rv = sendq_append(mgr, bufinfo);
+    /** Out of memory; the data cannot be dropped silently */
+    lcb_assert(rv == 0);
+    (void)rv;
+}
+
+void
+netbuf_enqueue_span(nb_MGR *mgr, nb_SPAN *span)
+{
+    nb_IOV spinfo = NETBUF_IOV_INIT(SPAN_BUFFER(span), span->size);
+    int rv = sendq_append(mgr, &spinfo);
+    lcb_assert(rv == 0);
+    (void)rv;
+}
+
+int
+netbuf_enqueue_span_owned(nb_MGR *mgr, nb_SPAN *span)
+{
+    nb_SENDQ *q = &mgr->sendq;
+    nb_SNDQOWNED *owned;
+    nb_IOV spinfo = NETBUF_IOV_INIT(SPAN_BUFFER(span), span->size);
+
+    if (sendq_grow_owned(mgr) != 0 || sendq_append(mgr, &spinfo) != 0) {
+        return -1;
+    }
+
+    owned = OWNED_AT(q, q->nowned);
+    owned->span = *span;
+    owned->shared = NULL;
+    owned->end = q->enqueued;
+    q->nowned++;
+    return 0;
+}
+
+int
+netbuf_enqueue_copy(nb_MGR *mgr, const nb_IOV *iovs, unsigned int niov,
+                    nb_SPAN *span)
+{
+    nb_SIZE ntthreshold = mgr->settings.copy_ntthreshold;
+    unsigned int ii;
+    nb_IOV iov;
+    char *dst;
+
+    span->size = 0;
+    for (ii = 0; ii < niov; ii++) {
+        if (iovs[ii].iov_len > (nb_SIZE)-1 - span->size) {
+            return -1;
+        }
+        span->size += iovs[ii].iov_len;
+    }
+
+    if (!span->size ||
+            mblock_reserve_data(&mgr->datapool, span,
+                                NETBUF_RESERVE_INORDER) != 0) {
+        return -1;
+    }
+
+    dst = SPAN_BUFFER(span);
+    for (ii = 0; ii < niov; ii++) {
+        if (ntthreshold && iovs[ii].iov_len >= ntthreshold) {
+            copy_nontemporal(dst, iovs[ii].iov_base, iovs[ii].iov_len);
+        } else {
+            memcpy(dst, iovs[ii].iov_base, iovs[ii].iov_len);
+        }
+        dst += iovs[ii].iov_len;
+    }
+
+    iov.iov_base = SPAN_BUFFER(span);
+    iov.iov_len = span->size;
+    if (sendq_append(mgr, &iov) != 0) {
+        netbuf_mblock_release(mgr, span);
+        return -1;
+    }
+    return 0;
+}
+
+nb_SIZE
+netbuf_start_flush(nb_MGR *mgr, nb_IOV *iovs, int niov, int *nused)
+{
+    return netbuf_start_flush2(mgr, iovs, niov, nused, (nb_SIZE)-1);
+}
+
+nb_SIZE
+netbuf_start_flush2(nb_MGR *mgr, nb_IOV *iovs, int niov, int *nused,
+                    nb_SIZE maxbytes)
+{
+    nb_SIZE ret = 0;
+    nb_IOV *iov_end, *iov_start = iovs;
+    nb_IOV *iov = iovs;
+    nb_SENDQ *sq = &mgr->sendq;
+    unsigned int ix = sq->nrequested;
+
+    if (niov > NETBUFS_IOV_MAX) {
+        niov = NETBUFS_IOV_MAX;
+    }
+    if (niov <= 0 || !maxbytes) {
+        return 0;
+    }
+    iov_end = iovs + niov;
+
+    if (ix) {
+        nb_IOV *last = SENDQ_AT(sq, ix - 1);
+        if (sq->last_offset != last->iov_len) {
+            assert(last->iov_len > sq->last_offset);
+
+            iov->iov_len = MINIMUM(last->iov_len - sq->last_offset, maxbytes);
+            iov->iov_base = (char *)last->iov_base + sq->last_offset;
+            sq->last_offset += iov->iov_len;
+            ret += iov->iov_len;
+            iov++;
+        }
+    }
+
+    /** Copy the entries in (at most two) contiguous runs */
+    while (ix < sq->count && iov != iov_end && ret != maxbytes) {
+        unsigned int pos = (sq->head + ix) & (sq->nalloc - 1);
+        unsigned int ncopy = MINIMUM(sq->count - ix, sq->nalloc - pos);
+        nb_IOV *run_end;
+
+        ncopy = MINIMUM(ncopy, (unsigned int)(iov_end - iov));
+        memcpy(iov, sq->ring + pos, sizeof(*iov) * ncopy);
+        for (run_end = iov + ncopy; iov != run_end; iov++) {
+            ix++;
+            if (iov->iov_len >= maxbytes - ret) {
+                /** Split the entry at the end of the budget */
+                iov->iov_len = maxbytes - ret;
+                ret = maxbytes;
+                iov++;
+                break;
+            }
+            ret += iov->iov_len;
+        }
+    }
+
+    if (ix != sq->nrequested) {
+        sq->nrequested = ix;
+        sq->last_offset = iov[-1].iov_len;
+    }
+    if (ret) {
+        sq->nflushing++;
+        if (nused) {
+            *nused = iov - iov_start;
+        }
+    }
+    sq->requested += ret;
+
+    return ret;
+}
+
+void
+netbuf_end_flush(nb_MGR *mgr, unsigned int nflushed)
+{
+    nb_SENDQ *q = &mgr->sendq;
+
+    q->flushed += nflushed;
+    if (q->nflushing) {
+        q->nflushing--;
+    }
+    if (q->nowned) {
+        sendq_release_owned(mgr, 0);
+    }
+
+    while (q->count && nflushed) {
+        nb_IOV *win = q->ring + q->head;
+        nb_SIZE to_chop = MINIMUM(win->iov_len, nflushed);
+
+        win->iov_len -= to_chop;
+        nflushed -= to_chop;
+        if (q->nrequested == 1) {
+            /** Other requests may still be in flight from this entry */
+            q->last_offset -= to_chop;
+        }
+
+        if (!win->iov_len) {
+            q->head = (q->head + 1) & (q->nalloc - 1);
+            q->count--;
+            if (q->nrequested) {
+                q->nrequested--;
+            }
+
+        } else {
+            win->iov_base = (char *)win->iov_base + to_chop;
+        }
+    }
+
+    if (!q->nflushing || q->flushed == q->requested) {
+        /** Anything left of the last request is requested again */
+        netbuf_rewind_flush(mgr);
+    }
+
+    if (mgr->ndeferred) {
+        sendq_release_deferred(mgr);
+    }
+}
+
+void
+netbuf_pdu_enqueue(nb_MGR *mgr, void *pdu, nb_SIZE lloff)
+{
+    nb_SENDQ *q = &mgr->sendq;
+    slist_append(&q->pdus, (slist_node *) ( (char *)pdu + lloff));
+}
+
+void
+netbuf_end_flush2(nb_MGR *mgr,
+                  unsigned int nflushed,
+                  nb_getsize_fn callback,
+                  nb_SIZE lloff,
+                  void *arg)
+{
+    slist_iterator iter;
+    nb_SENDQ *q = &mgr->sendq;
+    netbuf_end_flush(mgr, nflushed);
+
+    nflushed += q->pdu_offset;
+    SLIST_ITERFOR(&q->pdus, &iter) {
+        nb_SIZE cursize;
+        char *ptmp = (char *)iter.cur;
+
+        cursize = callback(ptmp - lloff, nflushed, arg);
+        if (cursize > nflushed) {
+            q->pdu_offset = cursize - nflushed;
+            break;
+        }
+
+        nflushed -= cursize;
+
+        slist_iter_remove(&q->pdus, &iter);
+
+        if (!nflushed) {
+            break;
+        }
+    }
+
+    if (mgr->ndeferred) {
+        sendq_release_deferred(mgr);
+    }
+}
+
+void
+netbuf_rewind_flush(nb_MGR *mgr)
+{
+    nb_SENDQ *q = &mgr->sendq;
+    q->nrequested = 0;
+    q->last_offset = 0;
+    q->nflushing = 0;
+    q->requested = q->flushed;
+}
+
+#ifndef _WIN32
+/** Number of IOVs passed to each sendmsg() call by netbuf_flush_fd() */
+#define FLUSH_FD_NIOV 64
+
+/**
+ * Makes room for one more pending zerocopy write
+ * @return 0 if successful, -1 otherwise
+ */
+static int
+sendq_grow_zc(nb_MGR *mgr)
+{
+    nb_SENDQ *q = &mgr->sendq;
+    unsigned int ii, nalloc = q->zc_nalloc ? q->zc_nalloc * 2 : 16;
+    nb_SNDQZC *arr;
+
+    if (q->nzc != q->zc_nalloc) {
+        return 0;
+    }
+
+    arr = mgr_alloc(mgr, sizeof(*arr) * nalloc);
+    if (!arr) {
+        return -1;
+    }
+    for (ii = 0; ii < q->nzc; ii++) {
+        arr[ii] = *ZC_AT(q, ii);
+    }
+    if (q->zc) {
+        mgr_free(mgr, q->zc, sizeof(*arr) * q->zc_nalloc);
+    }
+    q->zc = arr;
+    q->zc_head = 0;
+    q->zc_nalloc = nalloc;
+    return 0;
+}
+
+nb_FLUSHSTATUS
+netbuf_flush_fd(nb_MGR *mgr, int fd, int flags)
+{
+    nb_IOV iovs[FLUSH_FD_NIOV];
+    nb_SENDQ *q = &mgr->sendq;
+    int nozerocopy = 0;
+
+#if defined(NETBUFS_NO_MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+    if (!q->nosigpipe && !q->use_writev) {
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+        q->nosigpipe = 1;
+    }
+#endif
+
+    while (1) {
+        int niov = 0, zerocopy = 0;
+        nb_SIZE nb = netbuf_start_flush(mgr, iovs, FLUSH_FD_NIOV, &niov);
+        ssize_t nw;
+
+        if (!nb) {
+            return NB_FLUSH_DONE;
+        }
+
+        if (q->use_writev) {
+            nw = writev(fd, (struct iovec *)iovs, niov);
+        } else {
+            struct msghdr msg;
+            int sflags = flags | MSG_NOSIGNAL;
+
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = (struct iovec *)iovs;
+            msg.msg_iovlen = niov;
+#ifdef NETBUFS_HAVE_ZEROCOPY
+            if (q->zerocopy && !nozerocopy &&
+                    nb >= mgr->settings.zerocopy_threshold &&
+                    sendq_grow_zc(mgr) == 0) {
+                zerocopy = 1;
+                sflags |= MSG_ZEROCOPY;
+            }
+#endif
+            nw = sendmsg(fd, &msg, sflags);
+        }
+
+        if (nw < 0) {
+            int err = errno;
+            netbuf_end_flush(mgr, 0);
+            netbuf_rewind_flush(mgr);
+            errno = err;
+
+            if (err == EINTR) {
+                continue;
+            } else if (err == ENOTSOCK && !q->use_writev) {
+                q->use_writev = 1;
+                continue;
+            } else if (err == ENOBUFS && zerocopy) {
+                /** Out of option memory for the notification; copy instead */
+                nozerocopy = 1;
+                continue;
+            } else if (err == EAGAIN || err == EWOULDBLOCK) {
+                return NB_FLUSH_AGAIN;
+            }
+            return NB_FLUSH_ERROR;
+        }
+
+        if (zerocopy && nw > 0) {
+            /** Each successful zerocopy write is assigned the next id */
+            nb_SNDQZC *zc = ZC_AT(q, q->nzc);
+            zc->start = q->flushed;
+            zc->done = 0;
+            q->nzc++;
+        }
+
+        nozerocopy = 0;
+        netbuf_end_flush(mgr, (nb_SIZE)nw);
+        if ((nb_SIZE)nw != nb) {
+            netbuf_rewind_flush(mgr);
+        }
+    }
+}
+
+int
+netbuf_zerocopy_enable(nb_MGR *mgr, int fd)
+{
+#ifdef NETBUFS_HAVE_ZEROCOPY
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0) {
+        return -1;
+    }
+    mgr->sendq.zerocopy = 1;
+    return 0;
+#else
+    (void)mgr;
+    (void)fd;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+#ifdef NETBUFS_HAVE_ZEROCOPY
+/** Marks the zerocopy writes with ids in [lo, hi] as completed */
+static void
+sendq_zc_done(nb_SENDQ *q, unsigned int lo, unsigned int hi)
+{
+    unsigned int id = lo;
+    do {
+        unsigned int ix = id - q->zc_id;
+        if (ix < q->nzc) {
+            ZC_AT(q, ix)->done = 1;
+        }
+    } while (id++ != hi);
+
+    while (q->nzc && ZC_AT(q, 0)->done) {
+        q->zc_head = (q->zc_head + 1) % q->zc_nalloc;
+        q->nzc--;
+        q->zc_id++;
+    }
+}
+#endif
+
+int
+netbuf_zerocopy_complete(nb_MGR *mgr, int fd)
+{
+#ifdef NETBUFS_HAVE_ZEROCOPY
+    nb_SENDQ *q = &mgr->sendq;
+    int nread = 0;
+
+    while (1) {
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+        union {
+            char buf[CMSG_SPACE(sizeof(struct sock_extended_err) +
+                                sizeof(struct sockaddr_storage))];
+            struct cmsghdr align;
+        } control;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            struct sock_extended_err *ee;
+            if (!((cmsg->cmsg_level == IPPROTO_IP &&
+                    cmsg->cmsg_type == IP_RECVERR) ||
+                    (cmsg->cmsg_level == IPPROTO_IPV6 &&
+                     cmsg->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+
+            ee = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                q->zc_copied++;
+            }
+            sendq_zc_done(q, ee->ee_info, ee->ee_data);
+            nread++;
+        }
+    }
+
+    if (q->nowned) {
+        sendq_release_owned(mgr, 0);
+    }
+    if (mgr->ndeferred) {
+        sendq_release_deferred(mgr);
+    }
+    return nread;
+#else
+    (void)mgr;
+    (void)fd;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+unsigned int
+netbuf_get_zerocopy_pending(const nb_MGR *mgr)
+{
+    return mgr->sendq.nzc;
+}
+#endif
+
+/******************************************************************************
+ ******************************************************************************
+ ** Release                                                                  **
+ ******************************************************************************
+ ******************************************************************************/
+void
+netbuf_mblock_release(nb_MGR *mgr, nb_SPAN *span)
+{
+#ifdef NETBUFS_LIBC_PROXY
+    mgr_free(mgr, span->parent, span->parent->nalloc);
+#else
+    mblock_release_data(&mgr->datapool, span->parent, span->size, span->offset);
+#endif
+}
+
+#ifndef NETBUFS_LIBC_PROXY
+/**
+ * Orders spans by block, and then by position within the block's used
+ * region. Spans in the wrapped (second) segment follow the first segment.
+ */
+static int
+span_cmp(const void *a, const void *b)
+{
+    const nb_SPAN *sa = a, *sb = b;
+    nb_SIZE pa, pb;
+
+    if (sa->parent != sb->parent) {
+        return (size_t)sa->parent < (size_t)sb->parent ? -1 : 1;
+    }
+
+    pa = sa->offset < sa->parent->start
+            ? sa->offset + sa->parent->nalloc : sa->offset;
+    pb = sb->offset < sb->parent->start
+            ? sb->offset + sb->parent->nalloc : sb->offset;
+    return pa < pb ? -1 : pa > pb;
+}
+
+/**
+ * Empties the block at once if 'size' bytes, along with the block's queued
+ * out-of-order ranges, make up all of its used region.
+ * @return 0 if the block was emptied, nonzero otherwise
+ */
+static int
+mblock_release_all(nb_MBPOOL *pool, nb_MBLOCK *block, nb_SIZE size)
+{
+    nb_SIZE used = block->wrap - block->start;
+
+    if (block->flags & NB_MBLOCK_F_LARGE) {
+        return -1;
+    }
+    if (block->cursor != block->wrap) {
+        used += block->cursor;
+    }
+    if (block->deallocs) {
+        used -= block->deallocs->nbytes;
+    }
+    if (size != used) {
+        return -1;
+    }
+
+    if (block->deallocs) {
+        block->deallocs->nranges = 0;
+        block->deallocs->nbytes = 0;
+        ooo_put_queue(pool, block);
+    }
+    block->start = block->wrap = block->cursor = 0;
+    mblock_deactivate(pool, block);
+    return 0;
+}
+#endif
+
+void
+netbuf_mblock_release_many(nb_MGR *mgr, nb_SPAN *spans, unsigned int nspans)
+{
+#ifdef NETBUFS_LIBC_PROXY
+    unsigned int ii;
+    for (ii = 0; ii < nspans; ii++) {
+        netbuf_mblock_release(mgr, spans + ii);
+    }
+#else
+    unsigned int ii = 0;
+
+    nb_SIZE total = 0;
+
+    if (!nspans) {
+        return;
+    }
+
+    /**
+     * Commonly all the spans of a single block are released together, in
+     * which case there is no need to order them.
+     */
+    for (ii = 0; ii < nspans && spans[ii].parent == spans[0].parent; ii++) {
+        total += spans[ii].size;
+    }
+    if (ii == nspans &&
+            mblock_release_all(&mgr->datapool, spans[0].parent, total) == 0) {
+        return;
+    }
+
+    ii = 0;
+    qsort(spans, nspans, sizeof(*spans), span_cmp);
+
+    while (ii < nspans) {
+        nb_MBLOCK *block = spans[ii].parent;
+        nb_SIZE offset = spans[ii].offset;
+        nb_SIZE size = spans[ii].size;
+
+        for (ii++; ii < nspans && spans[ii].parent == block &&
+                spans[ii].offset == offset + size; ii++) {
+            size += spans[ii].size;
+        }
+        mblock_release_data(&mgr->datapool, block, size, offset);
+    }
+#endif
+}
+
+/** Spans and positions share a single allocation */
+#define DEFERRED_ALLOC_SIZE(n) ((sizeof(nb_SPAN) + sizeof(nb_SIZE)) * (n))
+
+int
+netbuf_mblock_release_deferred(nb_MGR *mgr, const nb_SPAN *span)
+{
+    if (mgr->ndeferred == mgr->ndeferalloc) {
+        unsigned int nalloc = mgr->ndeferalloc ? mgr->ndeferalloc * 2 : 16;
+        nb_SPAN *deferred = mgr_alloc(mgr, DEFERRED_ALLOC_SIZE(nalloc));
+        nb_SIZE *deferred_end;
+
+        if (!deferred) {
+            /** The data may still be in flight, so it cannot be released */
+            return -1;
+        }
+        deferred_end = (nb_SIZE *)(deferred + nalloc);
+
+        if (mgr->deferred) {
+            memcpy(deferred, mgr->deferred, sizeof(*deferred) * mgr->ndeferred);
+            memcpy(deferred_end, mgr->deferred_end,
+                   sizeof(*deferred_end) * mgr->ndeferred);
+            mgr_free(mgr, mgr->deferred, DEFERRED_ALLOC_SIZE(mgr->ndeferalloc));
+        }
+        mgr->deferred = deferred;
+        mgr->deferred_end = deferred_end;
+        mgr->ndeferalloc = nalloc;
+    }
+
+    mgr->deferred[mgr->ndeferred] = *span;
+    mgr->deferred_end[mgr->ndeferred] = mgr->sendq.enqueued;
+    mgr->ndeferred++;
+    return 0;
+}
+
+void
+netbuf_mblock_apply_deferred(nb_MGR *mgr)
+{
+    netbuf_mblock_release_many(mgr, mgr->deferred, mgr->ndeferred);
+    mgr->ndeferred = 0;
+}
+
+/******************************************************************************
+ ******************************************************************************
+ ** Shared Buffers                                                           **
+ ******************************************************************************
+ ******************************************************************************/
+#if defined(_WIN32)
+#define SHARED_INCREF(shared) InterlockedIncrement(&(shared)->refcount)
+#define SHARED_DECREF(shared) InterlockedDecrement(&(shared)->refcount)
+#elif defined(__GNUC__)
+#define SHARED_INCREF(shared) \
+    __atomic_add_fetch(&(shared)->refcount, 1, __ATOMIC_RELAXED)
+#define SHARED_DECREF(shared) \
+    __atomic_sub_fetch(&(shared)->refcount, 1, __ATOMIC_ACQ_REL)
+#else
+#define SHARED_INCREF(shared) (++(shared)->refcount)
+#define SHARED_DECREF(shared) (--(shared)->refcount)
+#endif
+
 static void
-mblock_release_ptr(nb_MBPOOL *pool, char * ptr, nb_SIZE size)
+shared_free_alloc(nb_SHARED *shared)
 {
-    nb_MBLOCK *block;
-    nb_SIZE offset;
-    slist_node *ll;
-
-#ifdef NETBUFS_LIBC_PROXY
-    block = (nb_MBLOCK *)(ptr - sizeof(*block));
-    free(block);
-    return;
-#endif
+    shared->allocator.free(shared->allocator.ctx, shared,
+                           sizeof(*shared) + shared->size);
+}
 
+nb_SHARED *
+netbuf_shared_alloc(const nb_ALLOCATOR *allocator, nb_SIZE size)
+{
+    nb_ALLOCATOR alloc;
+    nb_SHARED *shared;
 
-    SLIST_FOREACH(&pool->active, ll) {
-        block = SLIST_ITEM(ll, nb_MBLOCK, slnode);
-        if (block->root > ptr) {
-            continue;
-        }
-        if (block->root + block->nalloc <= ptr) {
-            continue;
-        }
-        offset = ptr - block->root;
-        mblock_release_data(pool, block, size, offset);
-        return;
+    if (allocator && allocator->alloc) {
+        alloc = *allocator;
+    } else {
+        memset(&alloc, 0, sizeof(alloc));
+        alloc.alloc = libc_alloc;
+        alloc.free = libc_free;
     }
 
-    abort();
+    shared = alloc.alloc(alloc.ctx, sizeof(*shared) + size);
+    if (!shared) {
+        return NULL;
+    }
+    netbuf_shared_init(shared, shared + 1, size, shared_free_alloc);
+    shared->allocator = alloc;
+    return shared;
 }
 
-static int
-mblock_get_next_size(const nb_MBPOOL *pool, int allow_wrap)
+void
+netbuf_shared_init(nb_SHARED *shared, void *buf, nb_SIZE size,
+                   nb_shared_free_fn free_fn)
 {
-    nb_MBLOCK *block;
-    if (SLIST_IS_EMPTY(&pool->avail)) {
-        return 0;
-    }
+    shared->buf = buf;
+    shared->size = size;
+    shared->refcount = 1;
+    shared->free_fn = free_fn;
+    memset(&shared->allocator, 0, sizeof(shared->allocator));
+    shared->data = NULL;
+}
 
-    block = FIRST_BLOCK(pool);
+void
+netbuf_shared_ref(nb_SHARED *shared)
+{
+    SHARED_INCREF(shared);
+}
 
-    if (BLOCK_HAS_DEALLOCS(block)) {
-        return 0;
+void
+netbuf_shared_unref(nb_SHARED *shared)
+{
+    if (SHARED_DECREF(shared) == 0 && shared->free_fn) {
+        shared->free_fn(shared);
     }
+}
 
-    if (!block->start) {
-        /** Plain 'ole buffer */
-        return block->nalloc - block->cursor;
-    }
+int
+netbuf_enqueue_shared(nb_MGR *mgr, nb_SHARED *shared)
+{
+    nb_SENDQ *q = &mgr->sendq;
+    nb_SNDQOWNED *owned;
+    nb_IOV iov;
 
-    if (block->cursor != block->wrap) {
-        /** Already in second region */
-        return block->start - block->cursor;
+    iov.iov_base = shared->buf;
+    iov.iov_len = shared->size;
+    if (sendq_grow_owned(mgr) != 0 || sendq_append(mgr, &iov) != 0) {
+        return -1;
     }
 
-    if (allow_wrap) {
-        return MINIMUM(block->nalloc - block->wrap, block->start);
-    }
+    netbuf_shared_ref(shared);
+    owned = OWNED_AT(q, q->nowned);
+    CREATE_STANDALONE_SPAN(&owned->span, shared->buf, shared->size);
+    owned->shared = shared;
+    owned->end = q->enqueued;
+    q->nowned++;
+    return 0;
+}
 
-    return block->nalloc - block->wrap;
+/******************************************************************************
+ ******************************************************************************
+ ** Writer                                                                   **
+ ******************************************************************************
+ ******************************************************************************/
+#define WRITER_SPANS(writer) ((writer)->spans ? (writer)->spans : (writer)->inl)
+
+void
+netbuf_writer_init(nb_WRITER *writer, nb_MGR *mgr)
+{
+    writer->mgr = mgr;
+    writer->cur.size = 0;
+    writer->spans = NULL;
+    writer->nspans = 0;
+    writer->nalloc = NB_WRITER_NINLINE;
+    writer->total = 0;
 }
 
+/**
+ * Enqueues the current chunk and records it for netbuf_writer_release().
+ * There is always room for it; see writer_open_chunk()
+ */
 static void
-free_blocklist(nb_MBPOOL *pool, slist_root *list)
+writer_close_chunk(nb_WRITER *writer)
 {
-    slist_iterator iter;
-    SLIST_ITERFOR(list, &iter) {
-        nb_MBLOCK *block = SLIST_ITEM(iter.cur, nb_MBLOCK, slnode);
-
-        if (block->root) {
-            free(block->root);
-            pool->mgr->total_bytes -= block->nalloc;
-        }
+    netbuf_enqueue_span(writer->mgr, &writer->cur);
+    WRITER_SPANS(writer)[writer->nspans++] = writer->cur;
+    writer->cur.size = 0;
+}
 
-        if (block->deallocs) {
-            slist_iterator dea_iter;
-            nb_DEALLOC_QUEUE *queue = block->deallocs;
+/**
+ * Reserves a new chunk for up to 'len' bytes. The chunk follows the last
+ * reserved span if the block it is in has any room left.
+ */
+static int
+writer_open_chunk(nb_WRITER *writer, nb_SIZE len)
+{
+    nb_MGR *mgr = writer->mgr;
+    nb_MBPOOL *pool = &mgr->datapool;
+    nb_SIZE room = mblock_get_next_size(pool, 0);
 
-            SLIST_ITERFOR(&queue->pending, &dea_iter) {
-                nb_QDEALLOC *qd = SLIST_ITEM(dea_iter.cur, nb_QDEALLOC, slnode);
-                mblock_release_ptr(&queue->qpool, (char *)qd, sizeof(*qd));
-            }
+    if (writer->nspans == writer->nalloc) {
+        unsigned int nalloc = writer->nalloc * 2;
+        nb_SPAN *spans = mgr_alloc(mgr, sizeof(*spans) * nalloc);
 
-            mblock_cleanup(&queue->qpool);
-            free(queue);
-            block->deallocs = NULL;
-            pool->mgr->total_bytes -= sizeof(*block->deallocs);
+        if (!spans) {
+            return -1;
         }
-
-        if (mblock_is_standalone(block)) {
-            pool->mgr->total_bytes -= sizeof(*block);
-            free(block);
+        memcpy(spans, WRITER_SPANS(writer), sizeof(*spans) * writer->nspans);
+        if (writer->spans) {
+            mgr_free(mgr, writer->spans, sizeof(*spans) * writer->nalloc);
         }
+        writer->spans = spans;
+        writer->nalloc = nalloc;
     }
-}
 
+    writer->cur.size = MINIMUM(len, pool->basealloc);
+    if (room && room < writer->cur.size) {
+        writer->cur.size = room;
+    }
 
-static void
-mblock_cleanup(nb_MBPOOL *pool)
-{
-    free_blocklist(pool, &pool->active);
-    free_blocklist(pool, &pool->avail);
-    free(pool->cacheblocks);
-    pool->mgr->total_bytes -= sizeof(*pool->cacheblocks) * pool->ncacheblocks;
+    if (mblock_reserve_data(pool, &writer->cur, NETBUF_RESERVE_INORDER) != 0) {
+        writer->cur.size = 0;
+        return -1;
+    }
+    return 0;
 }
 
-static void
-mblock_init(nb_MBPOOL *pool)
+int
+netbuf_writer_append(nb_WRITER *writer, const void *buf, nb_SIZE len)
 {
-    unsigned int ii;
-    pool->cacheblocks = calloc(pool->ncacheblocks, sizeof(*pool->cacheblocks));
-    for (ii = 0; ii < pool->ncacheblocks; ii++) {
-        pool->cacheblocks[ii].parent = pool;
+    const char *src = buf;
+    nb_MBPOOL *pool = &writer->mgr->datapool;
+
+    while (len) {
+        nb_SIZE oldsize = writer->cur.size;
+        nb_SIZE nw;
+
+        if (oldsize) {
+            nw = MINIMUM(len, pool->basealloc - oldsize);
+            if (!nw || mblock_extend_inplace(pool, &writer->cur, oldsize + nw)) {
+                writer_close_chunk(writer);
+                continue;
+            }
+        } else {
+            if (writer_open_chunk(writer, len) != 0) {
+                return -1;
+            }
+            nw = writer->cur.size;
+        }
+
+        memcpy((char *)SPAN_BUFFER(&writer->cur) + oldsize, src, nw);
+        src += nw;
+        len -= nw;
+        writer->total += nw;
     }
+    return 0;
 }
 
 int
-netbuf_mblock_reserve(nb_MGR *mgr, nb_SPAN *span)
+netbuf_writer_appendv(nb_WRITER *writer, const nb_IOV *iovs, unsigned int niov)
 {
-    return mblock_reserve_data(&mgr->datapool, span);
+    unsigned int ii;
+    for (ii = 0; ii < niov; ii++) {
+        if (netbuf_writer_append(writer, iovs[ii].iov_base,
+                                 iovs[ii].iov_len) != 0) {
+            return -1;
+        }
+    }
+    return 0;
 }
 
-/******************************************************************************
- ******************************************************************************
- ** Informational Routines                                                   **
- ******************************************************************************
- ******************************************************************************/
-nb_SIZE
-netbuf_mblock_get_next_size(const nb_MGR *mgr, int allow_wrap)
+void
+netbuf_writer_end(nb_WRITER *writer)
 {
-    return mblock_get_next_size(&mgr->datapool, allow_wrap);
+    if (writer->cur.size) {
+        writer_close_chunk(writer);
+    }
 }
 
-unsigned int
-netbuf_get_niov(nb_MGR *mgr)
+void
+netbuf_writer_release(nb_WRITER *writer)
 {
-    slist_node *ll;
-    unsigned int ret = 0;
-    SLIST_FOREACH(&mgr->sendq.pending, ll) {
-        ret++;
+    nb_MGR *mgr = writer->mgr;
+
+    if (writer->cur.size) {
+        netbuf_mblock_release(mgr, &writer->cur);
     }
+    netbuf_mblock_release_many(mgr, WRITER_SPANS(writer), writer->nspans);
 
-    return ret;
+    if (writer->spans) {
+        mgr_free(mgr, writer->spans, sizeof(*writer->spans) * writer->nalloc);
+    }
+    netbuf_writer_init(writer, mgr);
 }
 
 /******************************************************************************
  ******************************************************************************
- ** Flush Routines                                                           **
+ ** Read Buffer                                                              **
  ******************************************************************************
  ******************************************************************************/
-static nb_SNDQELEM *
-get_sendqe(nb_SENDQ* sq, const nb_IOV *bufinfo)
-{
-    nb_SNDQELEM *sndqe;
-    nb_SPAN span;
-    span.size = sizeof(*sndqe);
-    mblock_reserve_data(&sq->elempool, &span);
-    sndqe = (nb_SNDQELEM *)SPAN_BUFFER(&span);
-
-    sndqe->base = bufinfo->iov_base;
-    sndqe->len = bufinfo->iov_len;
-    return sndqe;
-}
+#define RDSEG_AT(rdbuf, ix) \
+    ((rdbuf)->segs + (((rdbuf)->head + (ix)) & ((rdbuf)->nalloc - 1)))
 
 void
-netbuf_enqueue(nb_MGR *mgr, const nb_IOV *bufinfo)
+netbuf_rdbuf_init(nb_RDBUF *rdbuf, nb_MGR *mgr)
 {
-    nb_SENDQ *q = &mgr->sendq;
-    nb_SNDQELEM *win;
+    memset(rdbuf, 0, sizeof(*rdbuf));
+    rdbuf->mgr = mgr;
+    rdbuf->segsize = mgr->datapool.basealloc;
+}
 
-    if (SLIST_IS_EMPTY(&q->pending)) {
-        win = get_sendqe(q, bufinfo);
-        slist_append(&q->pending, &win->slnode);
+/** Releases the remainder of the first segment, and removes it */
+static void
+rdbuf_pop_seg(nb_RDBUF *rdbuf)
+{
+    nb_RDSEG *seg = RDSEG_AT(rdbuf, 0);
 
-    } else {
-        win = SLIST_ITEM(q->pending.last, nb_SNDQELEM, slnode);
-        if (win->base + win->len == bufinfo->iov_base) {
-            win->len += bufinfo->iov_len;
+#ifdef NETBUFS_LIBC_PROXY
+    netbuf_mblock_release(rdbuf->mgr, &seg->span);
+#else
+    if (rdbuf->relpos < seg->span.size) {
+        nb_SPAN rest;
+        rest.parent = seg->span.parent;
+        rest.offset = seg->span.offset + rdbuf->relpos;
+        rest.size = seg->span.size - rdbuf->relpos;
+        netbuf_mblock_release(rdbuf->mgr, &rest);
+    }
+#endif
 
-        } else {
-            win = get_sendqe(q, bufinfo);
-            slist_append(&q->pending, &win->slnode);
-        }
+    rdbuf->head = (rdbuf->head + 1) & (rdbuf->nalloc - 1);
+    rdbuf->nsegs--;
+    if (rdbuf->fillix) {
+        rdbuf->fillix--;
     }
+    rdbuf->offset = 0;
+    rdbuf->relpos = 0;
 }
 
 void
-netbuf_enqueue_span(nb_MGR *mgr, nb_SPAN *span)
+netbuf_rdbuf_cleanup(nb_RDBUF *rdbuf)
 {
-    nb_IOV spinfo = NETBUF_IOV_INIT(SPAN_BUFFER(span), span->size);
-    netbuf_enqueue(mgr, &spinfo);
+    nb_MGR *mgr = rdbuf->mgr;
+    nb_SIZE segsize = rdbuf->segsize;
+
+    while (rdbuf->nsegs) {
+        rdbuf_pop_seg(rdbuf);
+    }
+    if (rdbuf->segs) {
+        mgr_free(mgr, rdbuf->segs, sizeof(*rdbuf->segs) * rdbuf->nalloc);
+    }
+    netbuf_rdbuf_init(rdbuf, mgr);
+    rdbuf->segsize = segsize;
 }
 
-nb_SIZE
-netbuf_start_flush(nb_MGR *mgr, nb_IOV *iovs, int niov, int *nused)
+/** Reserves a new segment at the end of the ring */
+static int
+rdbuf_push_seg(nb_RDBUF *rdbuf)
 {
-    nb_SIZE ret = 0;
-    nb_IOV *iov_end = iovs + niov + 1, *iov_start = iovs;
-    nb_IOV *iov = iovs;
-    slist_node *ll;
-    nb_SENDQ *sq = &mgr->sendq;
-    nb_SNDQELEM *win = NULL;
+    nb_MGR *mgr = rdbuf->mgr;
+    nb_MBPOOL *pool = &mgr->datapool;
+    nb_RDSEG *seg;
 
-    if (sq->last_requested) {
-        if (sq->last_offset != sq->last_requested->len) {
-            win = sq->last_requested;
-            assert(win->len > sq->last_offset);
+    if (rdbuf->nsegs == rdbuf->nalloc) {
+        unsigned int ii, nalloc = rdbuf->nalloc ? rdbuf->nalloc * 2 : 4;
+        nb_RDSEG *segs = mgr_alloc(mgr, sizeof(*segs) * nalloc);
 
-            iov->iov_len = win->len - sq->last_offset;
-            iov->iov_base = win->base + sq->last_offset;
-            ret += iov->iov_len;
-            iov++;
+        if (!segs) {
+            return -1;
         }
+        for (ii = 0; ii < rdbuf->nsegs; ii++) {
+            segs[ii] = *RDSEG_AT(rdbuf, ii);
+        }
+        if (rdbuf->segs) {
+            mgr_free(mgr, rdbuf->segs, sizeof(*segs) * rdbuf->nalloc);
+        }
+        rdbuf->segs = segs;
+        rdbuf->nalloc = nalloc;
+        rdbuf->head = 0;
+    }
 
-        ll = sq->last_requested->slnode.next;
-
-    } else {
-        ll = sq->pending.first;
+    seg = RDSEG_AT(rdbuf, rdbuf->nsegs);
+    seg->used = 0;
+    seg->span.size = rdbuf->segsize;
+    /** Large blocks are freed as a whole on the first release */
+    if (pool->largespan && seg->span.size > pool->largespan) {
+        seg->span.size = pool->largespan;
     }
+    if (mblock_reserve_data(pool, &seg->span, 0) != 0) {
+        return -1;
+    }
+    rdbuf->nsegs++;
+    return 0;
+}
 
-    while (ll && iov != iov_end) {
-        win = SLIST_ITEM(ll, nb_SNDQELEM, slnode);
-        iov->iov_len = win->len;
-        iov->iov_base = win->base;
+int
+netbuf_rdbuf_prepare(nb_RDBUF *rdbuf, nb_IOV *iovs, unsigned int niov,
+                     nb_SIZE want)
+{
+    unsigned int ii = rdbuf->fillix, n = 0;
+    nb_SIZE room = 0;
 
-        ret += iov->iov_len;
-        iov++;
-        ll = ll->next;
+    if (!want) {
+        want = 1;
     }
 
-    if (win) {
-        sq->last_requested = win;
-        sq->last_offset = win->len;
-    }
-    if (ret && nused) {
-        *nused = iov - iov_start;
+    for (; n < niov && (ii < rdbuf->nsegs || room < want); ii++) {
+        nb_RDSEG *seg;
+
+        if (ii == rdbuf->nsegs && rdbuf_push_seg(rdbuf) != 0) {
+            break;
+        }
+        seg = RDSEG_AT(rdbuf, ii);
+        iovs[n].iov_base = (char *)SPAN_BUFFER(&seg->span) + seg->used;
+        iovs[n].iov_len = seg->span.size - seg->used;
+        room += iovs[n].iov_len;
+        n++;
     }
 
-    return ret;
+    rdbuf->prepared = room;
+    return n || !niov ? (int)n : -1;
 }
 
-void
-netbuf_end_flush(nb_MGR *mgr, unsigned int nflushed)
+int
+netbuf_rdbuf_commit(nb_RDBUF *rdbuf, nb_SIZE nread)
 {
-    nb_SENDQ *q = &mgr->sendq;
-    slist_iterator iter;
-    SLIST_ITERFOR(&q->pending, &iter) {
-        nb_SNDQELEM *win = SLIST_ITEM(iter.cur, nb_SNDQELEM, slnode);
-        nb_SIZE to_chop = MINIMUM(win->len, nflushed);
-
-        win->len -= to_chop;
-        nflushed -= to_chop;
-        if (win == q->last_requested) {
-            q->last_requested = NULL;
-            q->last_offset = 0;
-        }
-
-        if (!win->len) {
-            slist_iter_remove(&q->pending, &iter);
-            mblock_release_ptr(&mgr->sendq.elempool, (char *)win, sizeof(*win));
+    if (nread > rdbuf->prepared) {
+        return -1;
+    }
+    rdbuf->prepared -= nread;
+    rdbuf->nbytes += nread;
 
-        } else {
-            win->base +=  to_chop;
-        }
+    while (nread) {
+        nb_RDSEG *seg = RDSEG_AT(rdbuf, rdbuf->fillix);
+        nb_SIZE n = MINIMUM(nread, seg->span.size - seg->used);
 
-        if (!nflushed) {
-            break;
+        seg->used += n;
+        nread -= n;
+        if (seg->used == seg->span.size) {
+            rdbuf->fillix++;
         }
     }
+    return 0;
 }
 
-void
-netbuf_pdu_enqueue(nb_MGR *mgr, void *pdu, nb_SIZE lloff)
+int
+netbuf_rdbuf_peek(const nb_RDBUF *rdbuf, void *buf, nb_SIZE len)
 {
-    nb_SENDQ *q = &mgr->sendq;
-    slist_append(&q->pdus, (slist_node *) ( (char *)pdu + lloff));
+    char *dst = buf;
+    nb_SIZE offset = rdbuf->offset;
+    unsigned int ii;
+
+    if (len > rdbuf->nbytes) {
+        return -1;
+    }
+
+    for (ii = 0; len; ii++) {
+        const nb_RDSEG *seg = RDSEG_AT(rdbuf, ii);
+        nb_SIZE n = MINIMUM(len, seg->used - offset);
+
+        memcpy(dst, (char *)SPAN_BUFFER(&seg->span) + offset, n);
+        dst += n;
+        len -= n;
+        offset = 0;
+    }
+    return 0;
 }
 
-void
-netbuf_end_flush2(nb_MGR *mgr,
-                  unsigned int nflushed,
-                  nb_getsize_fn callback,
-                  nb_SIZE lloff,
-                  void *arg)
+void *
+netbuf_rdbuf_contig(const nb_RDBUF *rdbuf, nb_SIZE *len)
 {
-    slist_iterator iter;
-    nb_SENDQ *q = &mgr->sendq;
-    netbuf_end_flush(mgr, nflushed);
-
-    nflushed += q->pdu_offset;
-    SLIST_ITERFOR(&q->pdus, &iter) {
-        nb_SIZE cursize;
-        char *ptmp = (char *)iter.cur;
+    const nb_RDSEG *seg;
 
-        cursize = callback(ptmp - lloff, nflushed, arg);
-        if (cursize > nflushed) {
-            q->pdu_offset = cursize - nflushed;
-            break;
-        }
+    if (!rdbuf->nbytes) {
+        *len = 0;
+        return NULL;
+    }
+    seg = RDSEG_AT(rdbuf, 0);
+    *len = seg->used - rdbuf->offset;
+    return (char *)SPAN_BUFFER(&seg->span) + rdbuf->offset;
+}
 
-        nflushed -= cursize;
+int
+netbuf_rdbuf_consume(nb_RDBUF *rdbuf, nb_SIZE len)
+{
+    if (len > rdbuf->nbytes) {
+        return -1;
+    }
+    rdbuf->nbytes -= len;
 
-        slist_iter_remove(&q->pdus, &iter);
+    while (len) {
+        nb_RDSEG *seg = RDSEG_AT(rdbuf, 0);
+        nb_SIZE n = MINIMUM(len, seg->used - rdbuf->offset);
 
-        if (!nflushed) {
-            break;
+        rdbuf->offset += n;
+        len -= n;
+        if (rdbuf->offset == seg->span.size) {
+            rdbuf_pop_seg(rdbuf);
         }
     }
+    return 0;
 }
 
-/******************************************************************************
- ******************************************************************************
- ** Release                                                                  **
- ******************************************************************************
- ******************************************************************************/
-void
-netbuf_mblock_release(nb_MGR *mgr, nb_SPAN *span)
+int
+netbuf_rdbuf_refspan(nb_RDBUF *rdbuf, nb_SIZE len, nb_SPAN *spans,
+                     unsigned int nspans)
 {
 #ifdef NETBUFS_LIBC_PROXY
-    free(span->parent);
+    if (!nspans || len > rdbuf->nbytes) {
+        return -1;
+    }
+    spans->size = len;
+    if (mblock_reserve_data(&rdbuf->mgr->datapool, spans, 0) != 0) {
+        return -1;
+    }
+    netbuf_rdbuf_peek(rdbuf, SPAN_BUFFER(spans), len);
+    netbuf_rdbuf_consume(rdbuf, len);
+    return 1;
 #else
-    mblock_release_data(&mgr->datapool, span->parent, span->size, span->offset);
+    nb_SIZE remaining = len, offset = rdbuf->offset;
+    unsigned int ii, n;
+
+    if (len > rdbuf->nbytes) {
+        return -1;
+    }
+
+    /** Count the segments first, so that nothing is consumed on failure */
+    for (n = 0; remaining; n++) {
+        nb_SIZE avail = RDSEG_AT(rdbuf, n)->used - offset;
+        remaining -= MINIMUM(remaining, avail);
+        offset = 0;
+    }
+    if (n > nspans) {
+        return -1;
+    }
+
+    for (ii = 0; ii < n; ii++) {
+        nb_RDSEG *seg = RDSEG_AT(rdbuf, 0);
+        nb_SIZE chunk = MINIMUM(len, seg->used - rdbuf->offset);
+
+        if (rdbuf->relpos < rdbuf->offset) {
+            /** Release the bytes consumed before the span */
+            nb_SPAN prev;
+            prev.parent = seg->span.parent;
+            prev.offset = seg->span.offset + rdbuf->relpos;
+            prev.size = rdbuf->offset - rdbuf->relpos;
+            netbuf_mblock_release(rdbuf->mgr, &prev);
+        }
+
+        spans[ii].parent = seg->span.parent;
+        spans[ii].offset = seg->span.offset + rdbuf->offset;
+        spans[ii].size = chunk;
+
+        rdbuf->offset += chunk;
+        rdbuf->relpos = rdbuf->offset;
+        rdbuf->nbytes -= chunk;
+        len -= chunk;
+        if (rdbuf->offset == seg->span.size) {
+            rdbuf_pop_seg(rdbuf);
+        }
+    }
+    return (int)n;
 #endif
 }
 
@@ -698,16 +2920,27 @@ void netbuf_default_settings(nb_SETTINGS *settings)
 {
     settings->data_basealloc = NB_DATA_BASEALLOC;
     settings->data_cacheblocks = NB_DATA_CACHEBLOCKS;
+    settings->data_placement = NB_DATA_PLACEMENT;
+    settings->data_scanblocks = NB_DATA_SCANBLOCKS;
+    settings->data_maxavail = NB_DATA_MAXAVAIL;
+    settings->data_maxavailbytes = NB_DATA_MAXAVAILBYTES;
+    settings->data_largespan = NB_DATA_LARGESPAN;
+    settings->copy_ntthreshold = NB_COPY_NTTHRESHOLD;
+    settings->copy_threshold = NB_COPY_THRESHOLD;
+    settings->zerocopy_threshold = NB_ZEROCOPY_THRESHOLD;
+    settings->prealloc = NB_PREALLOC;
+    settings->data_mmap_threshold = NB_DATA_MMAP_THRESHOLD;
+    settings->data_mmap_flags = NB_DATA_MMAP_FLAGS;
     settings->dea_basealloc = NB_MBDEALLOC_BASEALLOC;
     settings->dea_cacheblocks = NB_MBDEALLOC_CACHEBLOCKS;
     settings->sndq_basealloc = NB_SNDQ_BASEALLOC;
     settings->sndq_cacheblocks = NB_SNDQ_CACHEBLOCKS;
+    memset(&settings->allocator, 0, sizeof(settings->allocator));
 }
 
 void
 netbuf_init(nb_MGR *mgr, const nb_SETTINGS *user_settings)
 {
-    nb_MBPOOL *sqpool = &mgr->sendq.elempool;
     nb_MBPOOL *bufpool = &mgr->datapool;
 
     memset(mgr, 0, sizeof(*mgr));
@@ -718,31 +2951,74 @@ netbuf_init(nb_MGR *mgr, const nb_SETTINGS *user_settings)
         netbuf_default_settings(&mgr->settings);
     }
 
+    if (!mgr->settings.allocator.alloc) {
+        mgr->settings.allocator.alloc = libc_alloc;
+        mgr->settings.allocator.free = libc_free;
+    }
+
     /** Set our defaults */
-    sqpool->basealloc = sizeof(nb_SNDQELEM) * mgr->settings.sndq_basealloc;
-    sqpool->ncacheblocks = mgr->settings.sndq_cacheblocks;
-    sqpool->mgr = mgr;
-    mblock_init(sqpool);
+    if (mgr->settings.prealloc & NB_PREALLOC_SNDQ &&
+            sendq_resize(mgr, sendq_initial_size(mgr)) == 0 &&
+            mgr->settings.prealloc & NB_PREALLOC_PREFAULT) {
+        memset(mgr->sendq.ring, 0, sizeof(nb_IOV) * mgr->sendq.nalloc);
+    }
 
     bufpool->basealloc = mgr->settings.data_basealloc;
     bufpool->ncacheblocks = mgr->settings.data_cacheblocks;
+    bufpool->placement = mgr->settings.data_placement;
+    bufpool->scanblocks = mgr->settings.data_scanblocks;
+    bufpool->maxblocks = mgr->settings.data_maxavail;
+    bufpool->maxbytes = mgr->settings.data_maxavailbytes;
+    bufpool->mmap_threshold = mgr->settings.data_mmap_threshold;
+    bufpool->largespan = mgr->settings.data_largespan;
     bufpool->mgr = mgr;
-    mblock_init(bufpool);
+    mblock_init(bufpool, mgr->settings.prealloc & NB_PREALLOC_DATA,
+                mgr->settings.prealloc & NB_PREALLOC_PREFAULT);
 }
 
+void
+netbuf_trim(nb_MGR *mgr)
+{
+    nb_SENDQ *q = &mgr->sendq;
+
+    if (q->ring && !q->count &&
+            !(mgr->settings.prealloc & NB_PREALLOC_SNDQ)) {
+        mgr_free(mgr, q->ring, sizeof(*q->ring) * q->nalloc);
+        q->ring = NULL;
+        q->head = 0;
+        q->nalloc = 0;
+    }
+    mblock_trim(&mgr->datapool);
+}
 
 void
 netbuf_cleanup(nb_MGR *mgr)
 {
-    slist_iterator iter;
+    if (mgr->sendq.ring) {
+        mgr_free(mgr, mgr->sendq.ring,
+                 sizeof(*mgr->sendq.ring) * mgr->sendq.nalloc);
+        mgr->sendq.ring = NULL;
+    }
 
-    SLIST_ITERFOR(&mgr->sendq.pending, &iter) {
-        nb_SNDQELEM *e = SLIST_ITEM(iter.cur, nb_SNDQELEM, slnode);
-        slist_iter_remove(&mgr->sendq.pending, &iter);
-        mblock_release_ptr(&mgr->sendq.elempool, (char *)e, sizeof(*e));
+    sendq_release_owned(mgr, 1);
+    if (mgr->sendq.owned) {
+        mgr_free(mgr, mgr->sendq.owned,
+                 sizeof(*mgr->sendq.owned) * mgr->sendq.owned_nalloc);
+        mgr->sendq.owned = NULL;
+    }
+    if (mgr->sendq.zc) {
+        mgr_free(mgr, mgr->sendq.zc,
+                 sizeof(*mgr->sendq.zc) * mgr->sendq.zc_nalloc);
+        mgr->sendq.zc = NULL;
+    }
+
+    netbuf_mblock_apply_deferred(mgr);
+    if (mgr->deferred) {
+        mgr_free(mgr, mgr->deferred, DEFERRED_ALLOC_SIZE(mgr->ndeferalloc));
+        mgr->deferred = NULL;
+        mgr->deferred_end = NULL;
     }
 
-    mblock_cleanup(&mgr->sendq.elempool);
     mblock_cleanup(&mgr->datapool);
 }
 
@@ -796,12 +3072,13 @@ static void
 dump_sendq(nb_SENDQ *q)
 {
     const char *indent = "  ";
-    slist_node *ll;
+    unsigned int ii;
     printf("Send Queue\n");
-    SLIST_FOREACH(&q->pending, ll) {
-        nb_SNDQELEM *e = SLIST_ITEM(ll, nb_SNDQELEM, slnode);
-        printf("%s[Base=%p, Len=%u]\n", indent, e->base, e->len);
-        if (q->last_requested == e) {
+    for (ii = 0; ii < q->count; ii++) {
+        nb_IOV *e = SENDQ_AT(q, ii);
+        printf("%s[Base=%p, Len=%u]\n", indent, e->iov_base,
+               (unsigned int)e->iov_len);
+        if (q->nrequested == ii + 1) {
             printf("%s<Current Flush Limit @%u^^^>\n", indent, q->last_offset);
         }
     }
@@ -810,12 +3087,12 @@ dump_sendq(nb_SENDQ *q)
 void
 netbuf_dump_status(nb_MGR *mgr)
 {
-    slist_node *ll;
+    dlist_node *ll;
     printf("Status for MGR=%p [nallocs=%u]\n", (void *)mgr, mgr->total_allocs);
     printf("ACTIVE:\n");
 
-    SLIST_FOREACH(&mgr->datapool.active, ll) {
-        nb_MBLOCK *block = SLIST_ITEM(ll, nb_MBLOCK, slnode);
+    DLIST_FOREACH(&mgr->datapool.active, ll) {
+        nb_MBLOCK *block = DLIST_ITEM(ll, nb_MBLOCK, dlnode);
         dump_managed_block(block);
     }
     dump_sendq(&mgr->sendq);
@@ -34,6 +34,7 @@ extern "C" {
  */
 
 #include "slist.h"
+#include "dlist.h"
 #include "netbufs-defs.h"
 #include "netbufs-mblock.h"
 
@@ -62,16 +63,60 @@ typedef struct {
     (span)->size = len;
 
 
+struct netbufs_shared_st;
+
+/** Invoked once the last reference to a shared buffer has been dropped */
+typedef void (*nb_shared_free_fn)(struct netbufs_shared_st *shared);
+
+/**
+ * A reference counted buffer, which may be enqueued on any number of
+ * managers without being copied. See netbuf_enqueue_shared().
+ */
+typedef struct netbufs_shared_st {
+    void *buf;
+    nb_SIZE size;
+
+    /** Number of references. Modified atomically (with GCC, Clang or MSVC) */
+    long refcount;
+
+    nb_shared_free_fn free_fn;
+
+    /** Allocator of netbuf_shared_alloc(), used to free the buffer */
+    nb_ALLOCATOR allocator;
+
+    /** User data */
+    void *data;
+} nb_SHARED;
+
+/**
+ * A span owned by the send queue, holding data copied by netbuf_enqueue(),
+ * or a reference to a shared buffer.
+ */
 typedef struct {
-    slist_node slnode;
-    char *base;
-    nb_SIZE len;
-    /** Extra 4 bytes here. WHAT WE DO!!! */
-} nb_SNDQELEM;
+    nb_SPAN span;
+    /** If not NULL, the reference to drop rather than releasing the span */
+    nb_SHARED *shared;
+    /** Stream position (see nb_SENDQ::enqueued) at the end of the span */
+    nb_SIZE end;
+} nb_SNDQOWNED;
+
+/** A write sent with MSG_ZEROCOPY, awaiting its completion notification */
+typedef struct {
+    /** Stream position at the start of the write */
+    nb_SIZE start;
+    /** Whether the notification has arrived */
+    unsigned int done;
+} nb_SNDQZC;
 
 typedef struct {
-    /** Linked list of pending spans to send */
-    slist_root pending;
+    /**
+     * Circular array of pending buffers to send, in order. The capacity is
+     * always a power of two. Adjacent buffers are merged into one entry.
+     */
+    nb_IOV *ring;
+    unsigned int head;
+    unsigned int count;
+    unsigned int nalloc;
 
     /**
      * List of PDUs to be flushed. A PDU is comprised of one or more IOVs
@@ -79,21 +124,71 @@ typedef struct {
      */
     slist_root pdus;
 
-    /** The last window which was part of the previous fill call */
-    nb_SNDQELEM *last_requested;
+    /**
+     * Number of entries (from the head) which were part of previous fill
+     * calls. The last of these is the 'last requested' entry.
+     */
+    unsigned int nrequested;
 
     /**
-     * Number of bytes enqueued in the 'last request' element. This is needed
-     * because it is possible for the last element to grow in length during
-     * a subsequent flush.
+     * Number of bytes requested from the 'last requested' entry. This is
+     * needed because it is possible for the last entry to grow in length
+     * during a subsequent flush.
      */
     nb_SIZE last_offset;
 
+    /**
+     * Number of netbuf_start_flush() calls which returned data and have not
+     * yet been matched by a netbuf_end_flush() call
+     */
+    unsigned int nflushing;
+
     /** Offset from last PDU which was partially flushed */
     nb_SIZE pdu_offset;
 
-    /** Pool of elements to utilize */
-    nb_MBPOOL elempool;
+    /**
+     * Total number of bytes ever enqueued, returned by netbuf_start_flush(),
+     * and flushed. These wrap around, so they must only be compared by their
+     * difference.
+     */
+    nb_SIZE enqueued;
+    nb_SIZE requested;
+    nb_SIZE flushed;
+
+    /**
+     * Circular array of spans owned by the queue, in stream order. Each is
+     * released once 'flushed' reaches its end, and no zerocopy write which
+     * may still reference it is pending.
+     */
+    nb_SNDQOWNED *owned;
+    unsigned int owned_head;
+    unsigned int nowned;
+    unsigned int owned_nalloc;
+
+    /**
+     * Circular array of zerocopy writes awaiting notification, in order.
+     * The first has the kernel's notification id 'zc_id'.
+     */
+    nb_SNDQZC *zc;
+    unsigned int zc_head;
+    unsigned int nzc;
+    unsigned int zc_nalloc;
+    unsigned int zc_id;
+
+    /** Number of notifications for which the kernel copied the data anyway */
+    unsigned int zc_copied;
+
+    /** Whether MSG_ZEROCOPY is used (see netbuf_zerocopy_enable()) */
+    int zerocopy;
+
+    /**
+     * Whether netbuf_flush_fd() found the descriptor not to be a socket, and
+     * uses writev() instead of sendmsg()
+     */
+    int use_writev;
+
+    /** Whether netbuf_flush_fd() has set SO_NOSIGPIPE on the descriptor */
+    int nosigpipe;
 } nb_SENDQ;
 
 struct netbufs_st {
@@ -110,6 +205,13 @@ struct netbufs_st {
 
     /** Total number of bytes allocated */
     unsigned int total_bytes;
+
+    /** Spans passed to netbuf_mblock_release_deferred() */
+    nb_SPAN *deferred;
+    /** Send queue position to be flushed before each deferred span is released */
+    nb_SIZE *deferred_end;
+    unsigned int ndeferred;
+    unsigned int ndeferalloc;
 };
 
 /**
@@ -132,6 +234,74 @@ struct netbufs_st {
 int
 netbuf_mblock_reserve(nb_MGR *mgr, nb_SPAN *span);
 
+/**
+ * Flag for netbuf_mblock_reserve2(). Reserve the span only from the most
+ * recently used block (or a new one), regardless of the placement policy.
+ * Use this when the span must directly follow the previously reserved span
+ * (for example so that both may be coalesced into a single IOV).
+ */
+#define NETBUF_RESERVE_INORDER 0x01
+
+/**
+ * Like netbuf_mblock_reserve(), but with additional flags.
+ *
+ * Unless NETBUF_RESERVE_INORDER is specified, a span which does not fit in the
+ * most recently used block may be placed in an older block, depending on the
+ * 'data_placement' setting.
+ *
+ * @return 0 if successful, -1 on error
+ */
+int
+netbuf_mblock_reserve2(nb_MGR *mgr, nb_SPAN *span, int flags);
+
+/**
+ * Like netbuf_mblock_reserve(), but the span's buffer will be aligned to
+ * 'align' bytes, which must be a power of two. The span is reserved from
+ * the most recently used block (or a new one), regardless of the placement
+ * policy. Any padding needed in front of the span is reclaimed along with
+ * the neighbouring spans.
+ *
+ * @return 0 if successful, -1 on error
+ */
+int
+netbuf_mblock_reserve_aligned(nb_MGR *mgr, nb_SPAN *span, nb_SIZE align);
+
+/**
+ * Reserve several spans at once. The size of each span must be set. If
+ * possible the spans are placed back to back, in order, within a single
+ * block, so that once enqueued they are coalesced into a single IOV.
+ *
+ * Each span is released individually with netbuf_mblock_release(), as if it
+ * were reserved by itself.
+ *
+ * @return 0 if all the spans were reserved, -1 if none were
+ */
+int
+netbuf_mblock_reserve_many(nb_MGR *mgr, nb_SPAN *spans, unsigned int nspans);
+
+/**
+ * Grow a reserved span to 'size' bytes, preserving its contents. If the span
+ * is the last one reserved from its block and the block has room, the span
+ * is grown in place. Otherwise a new span is reserved and the contents are
+ * copied to it, in which case SPAN_BUFFER() will return a different address.
+ *
+ * @return 0 if successful, -1 on error (the span is left unchanged)
+ */
+int
+netbuf_mblock_extend(nb_MGR *mgr, nb_SPAN *span, nb_SIZE size);
+
+/**
+ * Shrink a reserved span to 'size' bytes, releasing the rest. The span's
+ * buffer does not move. If the span is the last one reserved from its block,
+ * the released bytes may be used for the next reservation. Truncating a span
+ * to 0 bytes releases it.
+ *
+ * This allows reserving a span for the maximum size of some data, and then
+ * committing only the size actually written.
+ */
+void
+netbuf_mblock_truncate(nb_MGR *mgr, nb_SPAN *span, nb_SIZE size);
+
 /**
  * Release a span previously allocated via reserve_span. It is assumed that the
  * contents of the span have either:
@@ -146,17 +316,59 @@ netbuf_mblock_reserve(nb_MGR *mgr, nb_SPAN *span);
 void
 netbuf_mblock_release(nb_MGR *mgr, nb_SPAN *span);
 
+/**
+ * Release several spans at once. The spans are ordered by block and position,
+ * and runs of adjacent spans are released as a single range. This is cheaper
+ * than releasing each span when the spans are released out of order.
+ *
+ * Note that the spans within the array are reordered.
+ */
+void
+netbuf_mblock_release_many(nb_MGR *mgr, nb_SPAN *spans, unsigned int nspans);
+
+/**
+ * Schedule a span to be released later. The span is released once everything
+ * enqueued so far has been flushed, at the end of netbuf_end_flush() or
+ * netbuf_end_flush2(), or explicitly via netbuf_mblock_apply_deferred().
+ * Spans which become releasable together are released together (see
+ * netbuf_mblock_release_many()). The span's memory remains reserved until
+ * then.
+ *
+ * If that data was written with MSG_ZEROCOPY (see netbuf_zerocopy_enable()),
+ * the span is only released by netbuf_zerocopy_complete() once the kernel is
+ * done with it.
+ *
+ * @return 0 on success, or -1 if out of memory, in which case the span is
+ * not released and remains owned by the caller
+ */
+int
+netbuf_mblock_release_deferred(nb_MGR *mgr, const nb_SPAN *span);
+
+/**
+ * Release all spans passed to netbuf_mblock_release_deferred(), whether or
+ * not the data enqueued before them has been flushed
+ */
+void
+netbuf_mblock_apply_deferred(nb_MGR *mgr);
+
 /**
  * Schedules an IOV to be placed inside the send queue. The storage of the
  * underlying buffer must not be freed or otherwise modified until it has
  * been sent.
  *
+ * If the buffer is smaller than the 'copy_threshold' setting, it is copied
+ * instead, and may be modified or freed as soon as this function returns.
+ *
  * With the current usage model, flush status is implicitly completed once
  * a response has arrived.
  *
  * Note that you may create the IOV from a SPAN object like so:
  * iov->iov_len = span->size;
  * iov->iov_base = SPAN_BUFFER(span);
+ *
+ * The send queue may need to grow. As this function cannot fail, running out
+ * of memory then triggers an assertion. Use netbuf_enqueue_copy() or
+ * netbuf_enqueue_span_owned() to handle it instead.
  */
 void
 netbuf_enqueue(nb_MGR *mgr, const nb_IOV *bufinfo);
@@ -164,6 +376,77 @@ netbuf_enqueue(nb_MGR *mgr, const nb_IOV *bufinfo);
 void
 netbuf_enqueue_span(nb_MGR *mgr, nb_SPAN *span);
 
+/**
+ * Enqueues a span, and passes its ownership to the send queue. The span is
+ * released once it has been flushed and, with zerocopy, once the kernel no
+ * longer references it.
+ *
+ * @return 0 on success, or -1 if memory could not be allocated, in which
+ *         case the span is not enqueued and remains owned by the caller
+ */
+int
+netbuf_enqueue_span_owned(nb_MGR *mgr, nb_SPAN *span);
+
+/**
+ * Allocates a shared buffer of 'size' bytes, with a single reference held by
+ * the caller. The buffer is freed once the last reference is dropped.
+ *
+ * @param allocator the allocator to obtain the memory from, typically the
+ *        'allocator' setting of the managers. If NULL (or if its 'alloc' is
+ *        NULL), malloc() and free() are used. It is copied, so it need not
+ *        outlive the call.
+ * @return the shared buffer, or NULL if memory could not be allocated
+ */
+nb_SHARED *
+netbuf_shared_alloc(const nb_ALLOCATOR *allocator, nb_SIZE size);
+
+/**
+ * Initializes a shared buffer for existing memory, with a single reference
+ * held by the caller. 'free_fn' is invoked once the last reference is
+ * dropped, and should free both the memory and 'shared' as needed.
+ */
+void
+netbuf_shared_init(nb_SHARED *shared, void *buf, nb_SIZE size,
+                   nb_shared_free_fn free_fn);
+
+/** Adds a reference to the shared buffer */
+void
+netbuf_shared_ref(nb_SHARED *shared);
+
+/** Drops a reference to the shared buffer, freeing it if it was the last */
+void
+netbuf_shared_unref(nb_SHARED *shared);
+
+/**
+ * Enqueues the contents of a shared buffer. The send queue holds its own
+ * reference, which is dropped once the buffer has been flushed (and, with
+ * zerocopy, once the kernel no longer references it). The caller's
+ * reference is unaffected, so it may enqueue the buffer on other managers
+ * and then drop its reference; the buffer is freed after the last manager
+ * is done with it.
+ *
+ * The contents must not be modified while the buffer is enqueued.
+ *
+ * @return 0 on success, or -1 if memory could not be allocated, in which
+ *         case nothing is enqueued
+ */
+int
+netbuf_enqueue_shared(nb_MGR *mgr, nb_SHARED *shared);
+
+/**
+ * Copies the contents of the given buffers into a new span, and enqueues it.
+ * The span is reserved with NETBUF_RESERVE_INORDER, so that it may be
+ * coalesced with the previously enqueued span. Large buffers are copied
+ * with non-temporal stores (see 'copy_ntthreshold').
+ *
+ * @param span receives the span, which must be released once it has been
+ *        flushed
+ * @return 0 if successful, -1 on error or if there is no data to copy
+ */
+int
+netbuf_enqueue_copy(nb_MGR *mgr, const nb_IOV *iovs, unsigned int niov,
+                    nb_SPAN *span);
+
 /**
  * Gets the number of IOV structures required to flush the entire contents of
  * all buffers.
@@ -185,7 +468,8 @@ netbuf_get_niov(nb_MGR *mgr);
  * netbuf_end_flush(mgr, nbytes2);
  *
  * Additionally, only the LAST end_flush call may be supplied an nflushed
- * parameter which is smaller than the size returned by start_flush.
+ * parameter which is smaller than the size returned by start_flush. The
+ * unflushed remainder is then returned again by the next start_flush.
  *
  * @param mgr the manager object
  * @param iov an array of iovec structures
@@ -202,6 +486,18 @@ netbuf_get_niov(nb_MGR *mgr);
 nb_SIZE
 netbuf_start_flush(nb_MGR *mgr, nb_IOV *iovs, int niov, int *nused);
 
+/**
+ * Like netbuf_start_flush(), but returns at most 'maxbytes' bytes. If the
+ * budget ends within a buffer, only the first part of it is returned, and
+ * the rest is returned by the next call. This allows a busy connection to
+ * yield to others.
+ *
+ * Both functions use no more than IOV_MAX structures, regardless of 'niov'.
+ */
+nb_SIZE
+netbuf_start_flush2(nb_MGR *mgr, nb_IOV *iovs, int niov, int *nused,
+                    nb_SIZE maxbytes);
+
 /**
  * Indicate that a number of bytes have been flushed. This should be called after
  * the data retrieved by get_flushing_iov has been flushed to the TCP buffers.
@@ -213,12 +509,36 @@ void
 netbuf_end_flush(nb_MGR *mgr, nb_SIZE nflushed);
 
 /**
- * Informational function to get the total size of all data in the
- * buffers. This traverses all blocks, so call this for debugging only.
+ * Forgets about the data returned by netbuf_start_flush() which has not been
+ * passed to netbuf_end_flush(), so that it is returned again by the next
+ * call. Use this after a short write, once nothing else is in flight.
+ */
+void
+netbuf_rewind_flush(nb_MGR *mgr);
+
+/**
+ * Gets the number of bytes enqueued which have not yet been flushed. This
+ * includes the bytes returned by netbuf_start_flush() which are still
+ * in flight.
  */
 nb_SIZE
 netbuf_get_size(const nb_MGR *mgr);
 
+/**
+ * Gets the number of bytes returned by netbuf_start_flush() which have not
+ * yet been passed to netbuf_end_flush().
+ */
+nb_SIZE
+netbuf_get_inflight(const nb_MGR *mgr);
+
+/**
+ * Gets the total number of bytes passed to netbuf_end_flush() over the
+ * manager's lifetime. This wraps around once it exceeds the range of
+ * nb_SIZE.
+ */
+nb_SIZE
+netbuf_get_flushed(const nb_MGR *mgr);
+
 /**
  * Get the maximum size of a span which can be satisfied without using an
  * additional block.
@@ -255,6 +575,16 @@ netbuf_init(nb_MGR *mgr, const nb_SETTINGS *settings);
 void
 netbuf_cleanup(nb_MGR *mgr);
 
+/**
+ * Returns the memory of emptied blocks kept for reuse to the system.
+ * Blocks allocated via the allocator are freed, while mapped blocks (see
+ * 'data_mmap_threshold') keep their address space but have their pages
+ * released with madvise(), so they may still be reused without a new
+ * mapping.
+ */
+void
+netbuf_trim(nb_MGR *mgr);
+
 /**
  * Populates the settings structure with the default settings. This structure
  * may then be modified or tuned and passed to netbuf_init()
@@ -324,6 +654,281 @@ netbuf_end_flush2(nb_MGR *mgr,
                   nb_getsize_fn callback,
                   nb_SIZE lloff, void *arg);
 
+typedef enum {
+    /** The send queue was drained */
+    NB_FLUSH_DONE = 0,
+    /** The descriptor cannot accept more data; wait until it is writable */
+    NB_FLUSH_AGAIN,
+    /** The descriptor failed. errno holds the reason */
+    NB_FLUSH_ERROR
+} nb_FLUSHSTATUS;
+
+#ifndef _WIN32
+/**
+ * Writes the send queue to a descriptor until it is drained or the descriptor
+ * would block. Data is written with sendmsg() and MSG_NOSIGNAL, or with
+ * writev() if the descriptor is not a socket. Short writes are handled, and
+ * the remaining data is written by the next call.
+ *
+ * A peer which went away gives EPIPE rather than raising SIGPIPE. Where
+ * MSG_NOSIGNAL is not available (e.g. macOS and some BSDs), SO_NOSIGPIPE is
+ * set on the socket instead; platforms with neither, and descriptors which
+ * are not sockets, still raise SIGPIPE unless it is ignored.
+ *
+ * A manager is assumed to always be flushed to the same descriptor: once a
+ * descriptor is found not to be a socket, writev() is used from then on.
+ *
+ * This calls netbuf_start_flush() and netbuf_end_flush() itself, and must
+ * not be used while data returned by netbuf_start_flush() is in flight.
+ *
+ * @param fd a (usually non-blocking) descriptor
+ * @param flags additional flags for sendmsg(), e.g. MSG_MORE
+ */
+nb_FLUSHSTATUS
+netbuf_flush_fd(nb_MGR *mgr, int fd, int flags);
+
+/**
+ * Makes netbuf_flush_fd() send writes of at least 'zerocopy_threshold' bytes
+ * with MSG_ZEROCOPY (Linux only). The kernel then reads the data directly
+ * from the buffers after sendmsg() returns, so spans enqueued with
+ * netbuf_enqueue_span_owned() are only released once the kernel's
+ * notification has been processed by netbuf_zerocopy_complete(). Buffers
+ * which are not owned by the queue must likewise stay untouched until
+ * netbuf_get_zerocopy_pending() is 0. A write which fails with ENOBUFS
+ * (the socket's option memory is exhausted by pending notifications) is
+ * retried without MSG_ZEROCOPY.
+ *
+ * @return 0 on success, or -1 if the socket does not support zerocopy
+ */
+int
+netbuf_zerocopy_enable(nb_MGR *mgr, int fd);
+
+/**
+ * Reads zerocopy notifications from the socket's error queue, and releases
+ * the owned and deferred spans (see netbuf_mblock_release_deferred()) which
+ * are no longer referenced. Call this when poll() reports POLLERR on the
+ * socket.
+ *
+ * @return the number of notifications read, or -1 with errno set
+ */
+int
+netbuf_zerocopy_complete(nb_MGR *mgr, int fd);
+
+/** Gets the number of zerocopy writes awaiting notification */
+unsigned int
+netbuf_get_zerocopy_pending(const nb_MGR *mgr);
+#endif
+
+/**
+ * Stream writer. A writer appends data to spans reserved from the manager's
+ * data pool, continuing in a new span whenever the current block is full.
+ * Each span (or "chunk") is enqueued once it is finished, so the written data
+ * is sent in order. Chunks are never larger than data_basealloc, so no block
+ * needs to be grown for them.
+ *
+ * The chunks remain reserved until netbuf_writer_release() is called, which
+ * should be done once the data has been flushed.
+ */
+/** Number of chunks a writer can track without allocating memory */
+#define NB_WRITER_NINLINE 8
+
+typedef struct {
+    nb_MGR *mgr;
+
+    /** Chunk currently being written to. Its size is 0 if there is none */
+    nb_SPAN cur;
+
+    /**
+     * Finished chunks. The first few are stored inline; 'spans' is only
+     * allocated (and used instead) once there are more.
+     */
+    nb_SPAN inl[NB_WRITER_NINLINE];
+    nb_SPAN *spans;
+    unsigned int nspans;
+    unsigned int nalloc;
+
+    /** Total number of bytes written */
+    nb_SIZE total;
+} nb_WRITER;
+
+/**
+ * Initializes a writer for the given manager
+ */
+void
+netbuf_writer_init(nb_WRITER *writer, nb_MGR *mgr);
+
+/**
+ * Appends data to the writer.
+ * @return 0 if successful, -1 if memory could not be allocated. In this
+ * case some of the data may have been written.
+ */
+int
+netbuf_writer_append(nb_WRITER *writer, const void *buf, nb_SIZE len);
+
+/**
+ * Appends the contents of several buffers to the writer
+ * @return 0 if successful, -1 on error (see netbuf_writer_append())
+ */
+int
+netbuf_writer_appendv(nb_WRITER *writer, const nb_IOV *iovs, unsigned int niov);
+
+/**
+ * Enqueues the chunk being written to. Further data will be written to a
+ * new chunk.
+ */
+void
+netbuf_writer_end(nb_WRITER *writer);
+
+/**
+ * Releases all the chunks of the writer. Any data which has not been enqueued
+ * (see netbuf_writer_end()) is discarded. The writer may be reused afterwards.
+ */
+void
+netbuf_writer_release(nb_WRITER *writer);
+
+/**
+ * Read buffer. Received data is read directly into spans ("segments")
+ * reserved from the manager's data pool, and stays there until it is
+ * consumed. A protocol parser may peek at and consume the data regardless of
+ * segment boundaries, and may take ownership of a range of received bytes as
+ * spans (see netbuf_rdbuf_refspan()) rather than copying them out.
+ *
+ * A typical read looks like this:
+ *
+ * niov = netbuf_rdbuf_prepare(&rdbuf, iovs, 2, 0);
+ * nr = readv(fd, iovs, niov);
+ * netbuf_rdbuf_commit(&rdbuf, nr);
+ * while (netbuf_rdbuf_peek(&rdbuf, hdr, sizeof(hdr)) == 0) { ... }
+ */
+typedef struct {
+    /** Reserved span */
+    nb_SPAN span;
+
+    /** Number of bytes received into the span */
+    nb_SIZE used;
+} nb_RDSEG;
+
+typedef struct {
+    nb_MGR *mgr;
+
+    /** Segments, in order of reception. Ring of 'nalloc' (power of 2) */
+    nb_RDSEG *segs;
+    unsigned int head;
+    unsigned int nsegs;
+    unsigned int nalloc;
+
+    /** Index (relative to 'head') of the first segment which is not full */
+    unsigned int fillix;
+
+    /** Number of bytes consumed from the first segment */
+    nb_SIZE offset;
+
+    /**
+     * Start of the consumed bytes of the first segment which have not yet
+     * been released back to the pool
+     */
+    nb_SIZE relpos;
+
+    /** Number of bytes received and not yet consumed */
+    nb_SIZE nbytes;
+
+    /** Room provided by netbuf_rdbuf_prepare() and not yet committed */
+    nb_SIZE prepared;
+
+    /**
+     * Size of newly reserved segments. Defaults to data_basealloc, so that
+     * segments never need a block of their own.
+     */
+    nb_SIZE segsize;
+} nb_RDBUF;
+
+/**
+ * Initializes a read buffer for the given manager. No memory is reserved
+ * until netbuf_rdbuf_prepare() is called.
+ */
+void
+netbuf_rdbuf_init(nb_RDBUF *rdbuf, nb_MGR *mgr);
+
+/**
+ * Releases all the segments of the read buffer, discarding any unconsumed
+ * data. Spans returned by netbuf_rdbuf_refspan() are not affected. The read
+ * buffer may be reused afterwards.
+ */
+void
+netbuf_rdbuf_cleanup(nb_RDBUF *rdbuf);
+
+/**
+ * Gets buffers to receive data into, e.g. with readv(). The buffers are the
+ * unfilled space of the existing segments, followed by newly reserved
+ * segments.
+ *
+ * @param iovs array to populate
+ * @param niov the number of elements in the array
+ * @param want the minimum number of bytes to provide room for (if 'niov'
+ *        allows it). If 0, only the room left in the existing segments is
+ *        provided, or a new segment if there is none
+ * @return the number of IOVs populated, or -1 if memory could not be
+ *         allocated and there is no room at all
+ */
+int
+netbuf_rdbuf_prepare(nb_RDBUF *rdbuf, nb_IOV *iovs, unsigned int niov,
+                     nb_SIZE want);
+
+/**
+ * Indicates that 'nread' bytes were received into the buffers returned by
+ * the last call to netbuf_rdbuf_prepare().
+ * @return 0 if successful, or -1 if 'nread' exceeds the room provided by
+ *         those buffers, in which case nothing is committed
+ */
+int
+netbuf_rdbuf_commit(nb_RDBUF *rdbuf, nb_SIZE nread);
+
+/** Gets the number of bytes received and not yet consumed */
+#define netbuf_rdbuf_get_size(rdbuf) ((rdbuf)->nbytes)
+
+/**
+ * Copies the first 'len' unconsumed bytes into 'buf', without consuming them
+ * @return 0 if successful, or -1 if fewer than 'len' bytes are available
+ */
+int
+netbuf_rdbuf_peek(const nb_RDBUF *rdbuf, void *buf, nb_SIZE len);
+
+/**
+ * Gets the unconsumed bytes which are contiguous in memory, i.e. those at
+ * the front of the first segment.
+ * @param[out] len the number of contiguous bytes
+ * @return a pointer to the first unconsumed byte, or NULL if there is none
+ */
+void *
+netbuf_rdbuf_contig(const nb_RDBUF *rdbuf, nb_SIZE *len);
+
+/**
+ * Consumes (discards) the first 'len' bytes
+ * @return 0 if successful, or -1 if fewer than 'len' bytes are available,
+ *         in which case nothing is consumed
+ */
+int
+netbuf_rdbuf_consume(nb_RDBUF *rdbuf, nb_SIZE len);
+
+/**
+ * Consumes the first 'len' bytes, transferring them to the caller as spans
+ * over the received data. One span is needed per segment the bytes are in.
+ * The spans must be released with netbuf_mblock_release() (or enqueued
+ * with netbuf_enqueue_span_owned()).
+ *
+ * In the NETBUFS_LIBC_PROXY build spans cannot be split, so the bytes are
+ * copied into a single new span instead.
+ *
+ * @param spans array to populate
+ * @param nspans the number of elements in the array
+ * @return the number of spans populated, or -1 if fewer than 'len' bytes are
+ *         available, 'nspans' is too small, or memory could not be allocated.
+ *         Nothing is consumed on failure.
+ */
+int
+netbuf_rdbuf_refspan(nb_RDBUF *rdbuf, nb_SIZE len, nb_SPAN *spans,
+                     unsigned int nspans);
+
 #ifdef __cplusplus
 }
 #endif
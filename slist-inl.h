@@ -76,10 +76,17 @@ slist_iter_incr(slist_root *list, slist_iterator *iter)
 static INLINE void
 slist_iter_remove(slist_root *list, slist_iterator *iter)
 {
-    iter->prev->next = iter->next;
     /** GCC strict aliasing. Yay. */
-    if ((void *)&list->first == (void *)iter->prev || list->first == NULL) {
-        list->last = NULL;
+    if ((void *)&list->first == (void *)iter->prev) {
+        list->first = iter->next;
+        if (!iter->next) {
+            list->last = NULL;
+        }
+    } else {
+        iter->prev->next = iter->next;
+        if (!iter->next) {
+            list->last = iter->prev;
+        }
     }
     iter->removed = 1;
 }
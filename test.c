@@ -1,3 +1,9 @@
+#ifndef _WIN32
+/* for socketpair() in strict ANSI builds */
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+#endif
 #include <stdio.h>
 #include <assert.h>
 #include <stdio.h>
@@ -6,13 +12,28 @@
 #include <stddef.h>
 #ifdef _WIN32
 #include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #endif
 #include "netbufs.h"
+#ifdef NETBUFS_HAVE_URING
+#include "netbufs-uring.h"
+#endif
 
 
 #define BIG_BUF_SIZE 5000
 #define SMALL_BUF_SIZE 50
 #define ASSERT_EQ(a, b) if ((a) != (b)) { *(char *)0x00 = 'A'; }
+#define ASSERT_NE(a, b) if ((a) == (b)) { *(char *)0x00 = 'A'; }
 
 static void test_basic(void)
 {
@@ -235,7 +256,7 @@ static void test_multi_flush(void)
     assert_iov_eq(iov, 50, 'B');
 
     netbuf_enqueue_span(&mgr, &span3);
-    sz = netbuf_start_flush(&mgr, &iov[1], 0, NULL);
+    sz = netbuf_start_flush(&mgr, &iov[1], 1, NULL);
     ASSERT_EQ(sz, 50);
     assert_iov_eq(&iov[1], 0, 'C');
     ASSERT_EQ(50, iov[1].iov_len);
@@ -355,6 +376,1914 @@ static void test_ooo(void)
 
     netbuf_cleanup(&mgr);
 }
+
+static void test_ooo_coalesce(void)
+{
+    nb_MGR mgr;
+    nb_SPAN spans[6];
+    nb_MBLOCK *block;
+    int ii;
+
+#ifdef NETBUFS_LIBC_PROXY
+    return;
+#endif
+
+    netbuf_init(&mgr, NULL);
+    for (ii = 0; ii < 6; ii++) {
+        spans[ii].size = 10;
+        ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, spans + ii));
+    }
+    block = spans[0].parent;
+
+    /** Adjacent ranges are merged into a single one */
+    netbuf_mblock_release(&mgr, &spans[3]);
+    netbuf_mblock_release(&mgr, &spans[1]);
+    ASSERT_EQ(2, block->deallocs->nranges);
+    netbuf_mblock_release(&mgr, &spans[2]);
+    ASSERT_EQ(1, block->deallocs->nranges);
+    ASSERT_EQ(10, block->deallocs->ranges[0].offset);
+    ASSERT_EQ(30, block->deallocs->ranges[0].size);
+
+    /** Reaching the range reclaims all of it */
+    netbuf_mblock_release(&mgr, &spans[0]);
+    ASSERT_EQ(40, block->start);
+    ASSERT_EQ(NULL, block->deallocs);
+
+    /** Releasing from the tail also reclaims ranges ending at the cursor */
+    spans[0].size = 10;
+    ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &spans[0]));
+    ASSERT_EQ(70, block->cursor);
+    netbuf_mblock_release(&mgr, &spans[5]);
+    ASSERT_EQ(1, block->deallocs->nranges);
+    netbuf_mblock_release(&mgr, &spans[0]);
+    ASSERT_EQ(50, block->cursor);
+    ASSERT_EQ(NULL, block->deallocs);
+
+    netbuf_mblock_release(&mgr, &spans[4]);
+    netbuf_cleanup(&mgr);
+}
+
+static void test_placement(void)
+{
+    nb_MGR mgr;
+    nb_SETTINGS settings;
+    nb_SPAN a, b, c, d;
+    int policy;
+
+#ifdef NETBUFS_LIBC_PROXY
+    return;
+#endif
+
+    for (policy = NB_PLACEMENT_SCAN; policy <= NB_PLACEMENT_FIT; policy++) {
+        netbuf_default_settings(&settings);
+        settings.data_basealloc = 64;
+        settings.data_placement = (nb_PLACEMENT)policy;
+        netbuf_init(&mgr, &settings);
+
+        a.size = 32;
+        b.size = 32;
+        ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &a));
+        ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &b));
+        netbuf_mblock_release(&mgr, &a);
+
+        /** Does not fit in the first block; starts a new one */
+        c.size = 40;
+        ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &c));
+        ASSERT_NE(b.parent, c.parent);
+
+        /** Must be placed in order, so it cannot use the first block */
+        d.size = 30;
+        ASSERT_EQ(0, netbuf_mblock_reserve2(&mgr, &d, NETBUF_RESERVE_INORDER));
+        ASSERT_NE(b.parent, d.parent);
+        ASSERT_NE(c.parent, d.parent);
+        netbuf_mblock_release(&mgr, &d);
+
+        /** Otherwise the first block's freed head is reused */
+        ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &d));
+        ASSERT_EQ(b.parent, d.parent);
+        ASSERT_EQ(0, d.offset);
+
+        netbuf_mblock_release(&mgr, &b);
+        netbuf_mblock_release(&mgr, &c);
+        netbuf_mblock_release(&mgr, &d);
+        netbuf_cleanup(&mgr);
+    }
+}
+
+static void test_retention(void)
+{
+    nb_MGR mgr;
+    nb_SETTINGS settings;
+    nb_SPAN spans[3];
+    unsigned int nallocs;
+    int ii;
+
+#ifdef NETBUFS_LIBC_PROXY
+    return;
+#endif
+
+    netbuf_default_settings(&settings);
+    settings.data_basealloc = 64;
+    settings.data_cacheblocks = 0;
+    settings.data_maxavail = 2;
+    settings.data_maxavailbytes = 192;
+    netbuf_init(&mgr, &settings);
+
+    spans[0].size = 128;
+    spans[1].size = 64;
+    spans[2].size = 64;
+    for (ii = 0; ii < 3; ii++) {
+        ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, spans + ii));
+    }
+    for (ii = 0; ii < 3; ii++) {
+        netbuf_mblock_release(&mgr, spans + ii);
+    }
+
+    /** The third block exceeds both limits */
+    ASSERT_EQ(2, mgr.datapool.curblocks);
+    ASSERT_EQ(192, mgr.datapool.curbytes);
+
+    /** Cached buffers are reused without allocating */
+    nallocs = mgr.total_allocs;
+    for (ii = 0; ii < 2; ii++) {
+        ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, spans + ii));
+    }
+    ASSERT_EQ(nallocs, mgr.total_allocs);
+    ASSERT_EQ(0, mgr.datapool.curblocks);
+    ASSERT_EQ(0, mgr.datapool.curbytes);
+
+    for (ii = 0; ii < 2; ii++) {
+        netbuf_mblock_release(&mgr, spans + ii);
+    }
+    netbuf_cleanup(&mgr);
+}
+
+static void test_prealloc(void)
+{
+    nb_MGR mgr;
+    nb_SETTINGS settings;
+    nb_SPAN spans[4];
+    unsigned int nallocs;
+    int ii;
+
+#ifdef NETBUFS_LIBC_PROXY
+    return;
+#endif
+
+    netbuf_default_settings(&settings);
+    settings.data_basealloc = 64;
+    settings.data_cacheblocks = 4;
+    settings.data_maxavail = 0;
+    settings.prealloc = NB_PREALLOC_DATA | NB_PREALLOC_PREFAULT;
+    netbuf_init(&mgr, &settings);
+    ASSERT_NE(NULL, mgr.datapool.slab);
+
+    /** Each span takes an entire block, all from the slab */
+    nallocs = mgr.total_allocs;
+    for (ii = 0; ii < 4; ii++) {
+        spans[ii].size = 64;
+        ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, spans + ii));
+        ASSERT_EQ(1, spans[ii].parent->root >= mgr.datapool.slab &&
+                  spans[ii].parent->root < mgr.datapool.slab + 256);
+    }
+    ASSERT_EQ(nallocs, mgr.total_allocs);
+
+    /** Slab blocks are kept even though no other blocks may be cached */
+    for (ii = 0; ii < 4; ii++) {
+        netbuf_mblock_release(&mgr, spans + ii);
+    }
+    for (ii = 0; ii < 4; ii++) {
+        ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, spans + ii));
+    }
+    ASSERT_EQ(nallocs, mgr.total_allocs);
+
+    for (ii = 0; ii < 4; ii++) {
+        netbuf_mblock_release(&mgr, spans + ii);
+    }
+    netbuf_cleanup(&mgr);
+}
+
+static void test_avail_classes(void)
+{
+    nb_MGR mgr;
+    nb_SETTINGS settings;
+    nb_SPAN small, big;
+    nb_MBLOCK *smallblk, *bigblk;
+
+#ifdef NETBUFS_LIBC_PROXY
+    return;
+#endif
+
+    netbuf_default_settings(&settings);
+    settings.data_basealloc = 64;
+    settings.data_maxavail = 4;
+    netbuf_init(&mgr, &settings);
+
+    big.size = 200;
+    ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &big));
+    small.size = 64;
+    ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &small));
+    bigblk = big.parent;
+    smallblk = small.parent;
+    ASSERT_EQ(256, bigblk->nalloc);
+    ASSERT_EQ(64, smallblk->nalloc);
+
+    netbuf_mblock_release(&mgr, &big);
+    netbuf_mblock_release(&mgr, &small);
+
+    /** A small span should not take the larger block */
+    small.size = 10;
+    ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &small));
+    ASSERT_EQ(smallblk, small.parent);
+
+    /** A bigger span must skip the smaller class entirely */
+    big.size = 100;
+    ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &big));
+    ASSERT_EQ(bigblk, big.parent);
+
+    ASSERT_EQ(4, mgr.datapool.avail_lookups);
+    ASSERT_EQ(2, mgr.datapool.avail_probes);
+
+    netbuf_mblock_release(&mgr, &small);
+    netbuf_mblock_release(&mgr, &big);
+    netbuf_cleanup(&mgr);
+}
+
+typedef struct {
+    unsigned int nallocs;
+    unsigned int nfrees;
+    nb_SIZE nbytes;
+} test_ALLOCSTATS;
+
+/** Each allocation is prefixed by its size, to verify the size on free */
+static void *test_alloc(void *ctx, nb_SIZE size)
+{
+    test_ALLOCSTATS *stats = ctx;
+    nb_SIZE *ret = malloc(sizeof(double) + size);
+    stats->nallocs++;
+    stats->nbytes += size;
+    *ret = size;
+    return (char *)ret + sizeof(double);
+}
+
+static void test_free(void *ctx, void *ptr, nb_SIZE size)
+{
+    test_ALLOCSTATS *stats = ctx;
+    nb_SIZE *hdr = (nb_SIZE *)((char *)ptr - sizeof(double));
+    ASSERT_EQ(*hdr, size);
+    stats->nfrees++;
+    stats->nbytes -= size;
+    free(hdr);
+}
+
+static nb_SIZE test_size_hint(void *ctx, nb_SIZE size)
+{
+    (void)ctx;
+    return (size + 4095) & ~4095U;
+}
+
+static void test_allocator(void)
+{
+    nb_MGR mgr;
+    nb_SETTINGS settings;
+    test_ALLOCSTATS stats;
+    nb_SPAN spans[64];
+    nb_IOV iov;
+    int ii;
+
+    memset(&stats, 0, sizeof(stats));
+    netbuf_default_settings(&settings);
+    settings.data_basealloc = 1000;
+    settings.data_cacheblocks = 2;
+    settings.dea_cacheblocks = 0;
+    settings.dea_basealloc = 1;
+    settings.prealloc = NB_PREALLOC_SNDQ;
+    settings.allocator.alloc = test_alloc;
+    settings.allocator.free = test_free;
+    settings.allocator.size_hint = test_size_hint;
+    settings.allocator.ctx = &stats;
+    netbuf_init(&mgr, &settings);
+
+    ASSERT_EQ(stats.nallocs, mgr.total_allocs);
+    ASSERT_EQ(stats.nbytes, mgr.total_bytes);
+
+    for (ii = 0; ii < 64; ii++) {
+        spans[ii].size = 100 + ii;
+        ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, spans + ii));
+        iov.iov_base = SPAN_BUFFER(spans + ii);
+        iov.iov_len = 1;
+        netbuf_enqueue(&mgr, &iov);
+    }
+    ASSERT_EQ(stats.nallocs, mgr.total_allocs);
+    ASSERT_EQ(stats.nbytes, mgr.total_bytes);
+
+#ifndef NETBUFS_LIBC_PROXY
+    /** Block buffers are sized according to the hint */
+    ASSERT_EQ(4096, spans[0].parent->nalloc);
+#endif
+
+    /** Out of order releases will need dealloc queues */
+    for (ii = 1; ii < 64; ii += 2) {
+        netbuf_mblock_release(&mgr, spans + ii);
+    }
+    ASSERT_EQ(stats.nallocs, mgr.total_allocs);
+    ASSERT_EQ(stats.nbytes, mgr.total_bytes);
+
+    for (ii = 0; ii < 64; ii += 2) {
+        netbuf_mblock_release(&mgr, spans + ii);
+    }
+    ASSERT_EQ(stats.nbytes, mgr.total_bytes);
+
+    netbuf_cleanup(&mgr);
+    ASSERT_EQ(stats.nallocs, stats.nfrees);
+    ASSERT_EQ(0, stats.nbytes);
+    ASSERT_EQ(0, mgr.total_bytes);
+}
+
+static void test_mmap(void)
+{
+    nb_MGR mgr;
+    nb_SETTINGS settings;
+    nb_SPAN span;
+    nb_MBLOCK *block;
+    unsigned int nallocs;
+    char *buf;
+
+#ifdef NETBUFS_LIBC_PROXY
+    return;
+#endif
+#ifdef _WIN32
+    return;
+#endif
+
+    netbuf_default_settings(&settings);
+    settings.data_basealloc = 4096;
+    settings.data_cacheblocks = 0;
+    settings.data_mmap_threshold = 8192;
+    settings.data_mmap_flags = NB_MMAP_HUGETLB | NB_MMAP_THP;
+    netbuf_init(&mgr, &settings);
+
+    /** Below the threshold */
+    span.size = 100;
+    ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &span));
+    ASSERT_EQ(0, span.parent->flags & NB_MBLOCK_F_MMAP);
+    netbuf_mblock_release(&mgr, &span);
+    netbuf_trim(&mgr);
+    ASSERT_EQ(0, mgr.datapool.curblocks);
+
+    /** Falls back to normal pages if there are no huge pages */
+    span.size = 10000;
+    ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &span));
+    block = span.parent;
+    ASSERT_NE(0, block->flags & NB_MBLOCK_F_MMAP);
+    ASSERT_EQ(1, block->nalloc >= 16384);
+    buf = SPAN_BUFFER(&span);
+    memset(buf, 'x', span.size);
+    netbuf_mblock_release(&mgr, &span);
+
+    /** Trimming keeps the mapping, but drops its contents */
+    nallocs = mgr.total_allocs;
+    netbuf_trim(&mgr);
+    ASSERT_EQ(1, mgr.datapool.curblocks);
+    ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &span));
+    ASSERT_EQ(block, span.parent);
+    ASSERT_EQ(nallocs, mgr.total_allocs);
+    buf = SPAN_BUFFER(&span);
+    ASSERT_EQ(0, buf[0]);
+    ASSERT_EQ(0, buf[span.size - 1]);
+
+    netbuf_mblock_release(&mgr, &span);
+    netbuf_cleanup(&mgr);
+    ASSERT_EQ(0, mgr.total_bytes);
+}
+
+static void test_large_span(void)
+{
+    nb_MGR mgr;
+    nb_SETTINGS settings;
+    nb_SPAN small, large;
+    nb_SIZE nbytes;
+
+#ifdef NETBUFS_LIBC_PROXY
+    return;
+#endif
+
+    netbuf_default_settings(&settings);
+    settings.data_basealloc = 1024;
+    settings.data_largespan = 1024;
+    settings.data_maxavail = 4;
+    netbuf_init(&mgr, &settings);
+
+    small.size = 100;
+    ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &small));
+    nbytes = mgr.total_bytes;
+
+    /** Allocated exactly, rather than in a block of 8192 bytes */
+    large.size = 5000;
+    ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &large));
+    ASSERT_NE(small.parent, large.parent);
+    ASSERT_EQ(5000, large.parent->nalloc);
+    ASSERT_NE(0, large.parent->flags & NB_MBLOCK_F_LARGE);
+
+    /** Other spans are never placed in the large block */
+    netbuf_mblock_release(&mgr, &small);
+    small.size = 100;
+    ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &small));
+    ASSERT_NE(large.parent, small.parent);
+
+    /** Freed on release, rather than kept in the available list */
+    netbuf_mblock_release(&mgr, &large);
+    ASSERT_EQ(nbytes, mgr.total_bytes);
+    ASSERT_EQ(0, mgr.datapool.curblocks);
+
+    /** Spans up to the threshold still use the normal blocks */
+    large.size = 1024;
+    ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &large));
+    ASSERT_EQ(0, large.parent->flags & NB_MBLOCK_F_LARGE);
+
+    netbuf_mblock_release(&mgr, &large);
+    netbuf_mblock_release(&mgr, &small);
+    netbuf_cleanup(&mgr);
+}
+
+/** Allocator which fails once the given number of allocations is reached */
+static void *test_alloc_limited(void *ctx, nb_SIZE size)
+{
+    unsigned int *remaining = ctx;
+    if (!*remaining) {
+        return NULL;
+    }
+    (*remaining)--;
+    return malloc(size);
+}
+
+static void test_free_limited(void *ctx, void *ptr, nb_SIZE size)
+{
+    (void)ctx;
+    (void)size;
+    free(ptr);
+}
+
+static void test_reserve_many(void)
+{
+    nb_MGR mgr;
+    nb_SETTINGS settings;
+    nb_SPAN spans[3];
+    unsigned int remaining;
+    int ii;
+
+    netbuf_init(&mgr, NULL);
+    spans[0].size = 24;
+    spans[1].size = 10;
+    spans[2].size = 300;
+    ASSERT_EQ(0, netbuf_mblock_reserve_many(&mgr, spans, 3));
+    for (ii = 0; ii < 3; ii++) {
+        nb_IOV iov;
+        memset(SPAN_BUFFER(spans + ii), 'a' + ii, spans[ii].size);
+        iov.iov_base = SPAN_BUFFER(spans + ii);
+        iov.iov_len = spans[ii].size;
+        netbuf_enqueue(&mgr, &iov);
+    }
+#ifndef NETBUFS_LIBC_PROXY
+    /** The spans are contiguous */
+    ASSERT_EQ(1, netbuf_get_niov(&mgr));
+#endif
+    netbuf_end_flush(&mgr, 334);
+
+    /** Each span may be released on its own */
+    netbuf_mblock_release(&mgr, spans + 1);
+    netbuf_mblock_release(&mgr, spans + 2);
+    netbuf_mblock_release(&mgr, spans + 0);
+    ASSERT_EQ(1, DLIST_IS_EMPTY(&mgr.datapool.active));
+    netbuf_cleanup(&mgr);
+
+#ifdef NETBUFS_LIBC_PROXY
+    return;
+#endif
+
+    /**
+     * Spans which cannot share a block are reserved one by one. A failure
+     * for the last span must release the others.
+     */
+    netbuf_default_settings(&settings);
+    settings.data_basealloc = 64;
+    settings.data_cacheblocks = 0;
+    settings.data_largespan = 64;
+    settings.data_maxavail = 0;
+    settings.sndq_cacheblocks = 0;
+    settings.allocator.alloc = test_alloc_limited;
+    settings.allocator.free = test_free_limited;
+    settings.allocator.ctx = &remaining;
+    remaining = 5;
+    netbuf_init(&mgr, &settings);
+
+    for (ii = 0; ii < 3; ii++) {
+        spans[ii].size = 50;
+    }
+    ASSERT_EQ(-1, netbuf_mblock_reserve_many(&mgr, spans, 3));
+    ASSERT_EQ(1, DLIST_IS_EMPTY(&mgr.datapool.active));
+    ASSERT_EQ(0, mgr.total_bytes);
+
+    /** Enough memory for all three */
+    remaining = 6;
+    ASSERT_EQ(0, netbuf_mblock_reserve_many(&mgr, spans, 3));
+    ASSERT_NE(spans[0].parent, spans[2].parent);
+    for (ii = 0; ii < 3; ii++) {
+        netbuf_mblock_release(&mgr, spans + ii);
+    }
+    netbuf_cleanup(&mgr);
+}
+
+static void test_release_many(void)
+{
+    nb_MGR mgr;
+    nb_SETTINGS settings;
+    nb_SPAN spans[16], copy[16];
+    nb_IOV iov;
+    int ii;
+
+    netbuf_default_settings(&settings);
+    settings.data_basealloc = 256;
+    settings.data_maxavail = 0;
+    settings.dea_cacheblocks = 0;
+    netbuf_init(&mgr, &settings);
+
+    /** Spread over several blocks; release in an interleaved order */
+    for (ii = 0; ii < 16; ii++) {
+        spans[ii].size = 60;
+        ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, spans + ii));
+    }
+    for (ii = 0; ii < 8; ii++) {
+        copy[ii] = spans[15 - ii * 2];
+        copy[8 + ii] = spans[ii * 2];
+    }
+    netbuf_mblock_release_many(&mgr, copy, 16);
+#ifndef NETBUFS_LIBC_PROXY
+    ASSERT_EQ(1, DLIST_IS_EMPTY(&mgr.datapool.active));
+#endif
+
+    /** The rest of a single block, some of which was released already */
+    for (ii = 0; ii < 4; ii++) {
+        spans[ii].size = 60;
+        ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, spans + ii));
+    }
+    netbuf_mblock_release(&mgr, spans + 1);
+    copy[0] = spans[3];
+    copy[1] = spans[0];
+    copy[2] = spans[2];
+    netbuf_mblock_release_many(&mgr, copy, 3);
+#ifndef NETBUFS_LIBC_PROXY
+    ASSERT_EQ(1, DLIST_IS_EMPTY(&mgr.datapool.active));
+    ASSERT_EQ(0, mgr.datapool.ndeacache);
+#endif
+
+    /** Deferred spans are held until the flush completes */
+    for (ii = 0; ii < 4; ii++) {
+        spans[ii].size = 60;
+        ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, spans + ii));
+    }
+    iov.iov_base = SPAN_BUFFER(spans);
+    iov.iov_len = 60;
+    netbuf_enqueue(&mgr, &iov);
+
+    for (ii = 3; ii >= 0; ii--) {
+        ASSERT_EQ(0, netbuf_mblock_release_deferred(&mgr, spans + ii));
+    }
+    ASSERT_EQ(4, mgr.ndeferred);
+#ifndef NETBUFS_LIBC_PROXY
+    ASSERT_EQ(0, DLIST_IS_EMPTY(&mgr.datapool.active));
+#endif
+
+    ASSERT_EQ(60, netbuf_start_flush(&mgr, &iov, 1, NULL));
+    netbuf_end_flush(&mgr, 60);
+    ASSERT_EQ(0, mgr.ndeferred);
+#ifndef NETBUFS_LIBC_PROXY
+    ASSERT_EQ(1, DLIST_IS_EMPTY(&mgr.datapool.active));
+#endif
+
+    /** Each span is held only until the data enqueued before it is flushed */
+    for (ii = 0; ii < 2; ii++) {
+        spans[ii].size = 60;
+        ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, spans + ii));
+        iov.iov_base = SPAN_BUFFER(spans + ii);
+        iov.iov_len = 60;
+        netbuf_enqueue(&mgr, &iov);
+        ASSERT_EQ(0, netbuf_mblock_release_deferred(&mgr, spans + ii));
+    }
+    ASSERT_NE(0, netbuf_start_flush(&mgr, &iov, 1, NULL));
+    netbuf_end_flush(&mgr, 60);
+    ASSERT_EQ(1, mgr.ndeferred);
+    ASSERT_EQ(60, netbuf_start_flush(&mgr, &iov, 1, NULL));
+    netbuf_end_flush(&mgr, 60);
+    ASSERT_EQ(0, mgr.ndeferred);
+#ifndef NETBUFS_LIBC_PROXY
+    ASSERT_EQ(1, DLIST_IS_EMPTY(&mgr.datapool.active));
+#endif
+
+    /** Applied on cleanup as well */
+    spans[0].size = 10;
+    ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, spans));
+    ASSERT_EQ(0, netbuf_mblock_release_deferred(&mgr, spans));
+    netbuf_cleanup(&mgr);
+    ASSERT_EQ(0, mgr.total_bytes);
+}
+
+static void test_extend_truncate(void)
+{
+    nb_MGR mgr;
+    nb_SETTINGS settings;
+    nb_SPAN a, b, c;
+    char *buf;
+
+    netbuf_default_settings(&settings);
+    settings.data_basealloc = 1024;
+    netbuf_init(&mgr, &settings);
+
+    a.size = 100;
+    b.size = 100;
+    ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &a));
+    ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &b));
+    memset(SPAN_BUFFER(&a), 'a', a.size);
+    memset(SPAN_BUFFER(&b), 'b', b.size);
+
+    /** The last span grows in place */
+    buf = SPAN_BUFFER(&b);
+    ASSERT_EQ(0, netbuf_mblock_extend(&mgr, &b, 300));
+    ASSERT_EQ(300, b.size);
+#ifndef NETBUFS_LIBC_PROXY
+    ASSERT_EQ(buf, SPAN_BUFFER(&b));
+#endif
+
+    /** Others are moved */
+    buf = SPAN_BUFFER(&a);
+    ASSERT_EQ(0, netbuf_mblock_extend(&mgr, &a, 200));
+    ASSERT_EQ(200, a.size);
+    ASSERT_NE(buf, SPAN_BUFFER(&a));
+    buf = SPAN_BUFFER(&a);
+    ASSERT_EQ('a', buf[0]);
+    ASSERT_EQ('a', buf[99]);
+
+    /** Shrinking the last span frees up room for the next one */
+    ASSERT_EQ(0, netbuf_mblock_extend(&mgr, &a, 600));
+    netbuf_mblock_truncate(&mgr, &a, 150);
+    ASSERT_EQ(150, a.size);
+    c.size = 10;
+    ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &c));
+#ifndef NETBUFS_LIBC_PROXY
+    ASSERT_EQ(buf, SPAN_BUFFER(&a));
+    ASSERT_EQ(a.parent, c.parent);
+    ASSERT_EQ(a.offset + 150, c.offset);
+#endif
+
+    /** Shrinking any other span releases its tail */
+    netbuf_mblock_truncate(&mgr, &a, 50);
+    ASSERT_EQ(50, a.size);
+    ASSERT_EQ('a', ((char *)SPAN_BUFFER(&a))[49]);
+
+    netbuf_mblock_truncate(&mgr, &b, 0);
+    netbuf_mblock_release(&mgr, &a);
+    netbuf_mblock_release(&mgr, &c);
+#ifndef NETBUFS_LIBC_PROXY
+    ASSERT_EQ(1, DLIST_IS_EMPTY(&mgr.datapool.active));
+#endif
+    netbuf_cleanup(&mgr);
+    ASSERT_EQ(0, mgr.total_bytes);
+}
+
+static void test_large_fit(void)
+{
+    nb_MGR mgr;
+    nb_SETTINGS settings;
+    nb_SPAN large, small;
+
+#ifdef NETBUFS_LIBC_PROXY
+    return;
+#endif
+
+    netbuf_default_settings(&settings);
+    settings.data_basealloc = 1024;
+    settings.data_largespan = 3000;
+    settings.data_placement = NB_PLACEMENT_FIT;
+    netbuf_init(&mgr, &settings);
+
+    /** Growing a truncated large span leaves room, but not for others */
+    large.size = 4000;
+    ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &large));
+    netbuf_mblock_truncate(&mgr, &large, 1000);
+    ASSERT_EQ(0, netbuf_mblock_extend(&mgr, &large, 2000));
+    ASSERT_EQ(4000, large.parent->nalloc);
+    ASSERT_EQ(NB_MBLOCK_NOFIT, large.parent->fitclass);
+    ASSERT_EQ(0, mgr.datapool.fitmask);
+
+    small.size = 100;
+    ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &small));
+    ASSERT_NE(large.parent, small.parent);
+    netbuf_mblock_release(&mgr, &large);
+    netbuf_mblock_release(&mgr, &small);
+
+    /** Likewise for the padding of an aligned large span */
+    large.size = 4000;
+    ASSERT_EQ(0, netbuf_mblock_reserve_aligned(&mgr, &large, 64));
+    ASSERT_NE(0, large.parent->flags & NB_MBLOCK_F_LARGE);
+    ASSERT_EQ(0, (size_t)SPAN_BUFFER(&large) % 64);
+    ASSERT_EQ(NB_MBLOCK_NOFIT, large.parent->fitclass);
+    ASSERT_EQ(0, mgr.datapool.fitmask);
+
+    small.size = 10;
+    ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &small));
+    ASSERT_NE(large.parent, small.parent);
+    netbuf_mblock_release(&mgr, &large);
+    netbuf_mblock_release(&mgr, &small);
+
+    netbuf_cleanup(&mgr);
+    ASSERT_EQ(0, mgr.total_bytes);
+}
+
+static void test_writer(void)
+{
+    nb_MGR mgr;
+    nb_SETTINGS settings;
+    nb_WRITER writer;
+    nb_IOV iovs[16];
+    char src[1000], dst[1000];
+    nb_SIZE nflushed, pos = 0;
+    int ii, niov = 0;
+
+    for (ii = 0; ii < 1000; ii++) {
+        src[ii] = (char)ii;
+    }
+
+    netbuf_default_settings(&settings);
+    settings.data_basealloc = 256;
+    netbuf_init(&mgr, &settings);
+    netbuf_writer_init(&writer, &mgr);
+
+    for (ii = 0; ii < 1000; ii += 40) {
+        ASSERT_EQ(0, netbuf_writer_append(&writer, src + ii, 20));
+        iovs[0].iov_base = src + ii + 20;
+        iovs[0].iov_len = 10;
+        iovs[1].iov_base = src + ii + 30;
+        iovs[1].iov_len = 10;
+        ASSERT_EQ(0, netbuf_writer_appendv(&writer, iovs, 2));
+    }
+    netbuf_writer_end(&writer);
+    ASSERT_EQ(1000, writer.total);
+
+#ifndef NETBUFS_LIBC_PROXY
+    /** One chunk per block, and no block was grown */
+    ASSERT_EQ(4, writer.nspans);
+    ASSERT_EQ(4, netbuf_get_niov(&mgr));
+    for (ii = 0; ii < 4; ii++) {
+        ASSERT_EQ(256, writer.inl[ii].parent->nalloc);
+    }
+#endif
+
+    while ((nflushed = netbuf_start_flush(&mgr, iovs, 16, &niov))) {
+        for (ii = 0; ii < niov; ii++) {
+            memcpy(dst + pos, iovs[ii].iov_base, iovs[ii].iov_len);
+            pos += iovs[ii].iov_len;
+        }
+        netbuf_end_flush(&mgr, nflushed);
+    }
+    ASSERT_EQ(1000, pos);
+    ASSERT_EQ(0, memcmp(src, dst, 1000));
+
+    netbuf_writer_release(&writer);
+#ifndef NETBUFS_LIBC_PROXY
+    ASSERT_EQ(1, DLIST_IS_EMPTY(&mgr.datapool.active));
+#endif
+
+    /** More chunks than can be tracked inline */
+    for (ii = 0; ii < 3; ii++) {
+        ASSERT_EQ(0, netbuf_writer_append(&writer, src, 1000));
+    }
+    netbuf_writer_end(&writer);
+    ASSERT_EQ(1, writer.nspans > NB_WRITER_NINLINE);
+    while ((nflushed = netbuf_start_flush(&mgr, iovs, 16, NULL))) {
+        netbuf_end_flush(&mgr, nflushed);
+    }
+    netbuf_writer_release(&writer);
+
+    /** Unfinished data is discarded on release */
+    ASSERT_EQ(0, netbuf_writer_append(&writer, src, 100));
+    netbuf_writer_release(&writer);
+    ASSERT_EQ(0, netbuf_get_niov(&mgr));
+
+    netbuf_cleanup(&mgr);
+    ASSERT_EQ(0, mgr.total_bytes);
+}
+
+static void test_aligned(void)
+{
+    static const nb_SIZE aligns[] = { 8, 16, 64, 4096 };
+    nb_MGR mgr;
+    nb_SETTINGS settings;
+    nb_SPAN spans[8];
+    int ii;
+
+    netbuf_default_settings(&settings);
+    settings.data_basealloc = 8192;
+    settings.data_maxavail = 0;
+    netbuf_init(&mgr, &settings);
+
+    ASSERT_EQ(-1, netbuf_mblock_reserve_aligned(&mgr, spans, 24));
+
+    for (ii = 0; ii < 8; ii++) {
+        spans[ii].size = 3 + ii;
+        ASSERT_EQ(0, netbuf_mblock_reserve_aligned(&mgr, spans + ii,
+                                                   aligns[ii % 4]));
+        ASSERT_EQ(0, (size_t)SPAN_BUFFER(spans + ii) & (aligns[ii % 4] - 1));
+        memset(SPAN_BUFFER(spans + ii), 'a' + ii, spans[ii].size);
+    }
+    for (ii = 0; ii < 8; ii++) {
+        ASSERT_EQ('a' + ii, *(char *)SPAN_BUFFER(spans + ii));
+    }
+
+    /** The padding is reclaimed, whatever the release order */
+    for (ii = 0; ii < 8; ii += 2) {
+        netbuf_mblock_release(&mgr, spans + ii);
+    }
+    for (ii = 7; ii > 0; ii -= 2) {
+        netbuf_mblock_release(&mgr, spans + ii);
+    }
+#ifndef NETBUFS_LIBC_PROXY
+    ASSERT_EQ(1, DLIST_IS_EMPTY(&mgr.datapool.active));
+
+    /** Wrap around to the start of the block */
+    spans[2].size = 4000;
+    ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, spans + 2));
+    spans[0].size = 4000;
+    ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, spans));
+    ASSERT_EQ(spans[2].parent, spans[0].parent);
+    netbuf_mblock_release(&mgr, spans + 2);
+
+    spans[1].size = 1000;
+    ASSERT_EQ(0, netbuf_mblock_reserve_aligned(&mgr, spans + 1, 1024));
+    ASSERT_EQ(spans[0].parent, spans[1].parent);
+    ASSERT_EQ(1, spans[1].offset < spans[0].offset);
+    ASSERT_EQ(0, (size_t)SPAN_BUFFER(spans + 1) & 1023);
+
+    netbuf_mblock_release(&mgr, spans + 1);
+    netbuf_mblock_release(&mgr, spans);
+    ASSERT_EQ(1, DLIST_IS_EMPTY(&mgr.datapool.active));
+#endif
+
+    netbuf_cleanup(&mgr);
+    ASSERT_EQ(0, mgr.total_bytes);
+}
+
+static void test_enqueue_copy(void)
+{
+    nb_MGR mgr;
+    nb_SETTINGS settings;
+    nb_SPAN spans[2];
+    nb_IOV iovs[3], out[4];
+    char src[1000], dst[2000];
+    nb_SIZE nflushed;
+    int ii, niov = 0;
+
+    for (ii = 0; ii < 1000; ii++) {
+        src[ii] = (char)(ii * 7);
+    }
+
+    netbuf_default_settings(&settings);
+    settings.copy_ntthreshold = 100;
+    netbuf_init(&mgr, &settings);
+
+    iovs[0].iov_base = src;
+    iovs[0].iov_len = 3;
+    iovs[1].iov_base = src + 3;
+    iovs[1].iov_len = 700;
+    iovs[2].iov_base = src + 703;
+    iovs[2].iov_len = 297;
+    ASSERT_EQ(0, netbuf_enqueue_copy(&mgr, iovs, 3, spans));
+    ASSERT_EQ(1000, spans[0].size);
+    ASSERT_EQ(0, netbuf_enqueue_copy(&mgr, iovs + 1, 2, spans + 1));
+    ASSERT_EQ(-1, netbuf_enqueue_copy(&mgr, iovs, 0, spans + 1));
+#ifndef NETBUFS_LIBC_PROXY
+    ASSERT_EQ(1, netbuf_get_niov(&mgr));
+#endif
+
+    nflushed = netbuf_start_flush(&mgr, out, 4, &niov);
+    ASSERT_EQ(1997, nflushed);
+    nflushed = 0;
+    for (ii = 0; ii < niov; ii++) {
+        memcpy(dst + nflushed, out[ii].iov_base, out[ii].iov_len);
+        nflushed += out[ii].iov_len;
+    }
+    ASSERT_EQ(0, memcmp(dst, src, 1000));
+    ASSERT_EQ(0, memcmp(dst + 1000, src + 3, 997));
+    netbuf_end_flush(&mgr, nflushed);
+
+    netbuf_mblock_release(&mgr, spans);
+    netbuf_mblock_release(&mgr, spans + 1);
+    netbuf_cleanup(&mgr);
+}
+
+static void test_hybrid_copy(void)
+{
+    nb_MGR mgr;
+    nb_SETTINGS settings;
+    nb_IOV iov, out[16];
+    char src[64], big[200], dst[1024];
+    nb_SIZE nflushed, total = 0;
+    int ii, niov;
+
+    for (ii = 0; ii < 64; ii++) {
+        src[ii] = (char)ii;
+    }
+    memset(big, 'B', sizeof(big));
+
+    netbuf_default_settings(&settings);
+    settings.copy_threshold = 16;
+    netbuf_init(&mgr, &settings);
+    /** Exercise wrap-around of the stream position */
+    mgr.sendq.enqueued = mgr.sendq.requested = (nb_SIZE)-10;
+    mgr.sendq.flushed = (nb_SIZE)-10;
+
+    /** Small, non-adjacent buffers are copied into a single IOV */
+    for (ii = 0; ii < 8; ii++) {
+        iov.iov_base = src + ii * 8;
+        iov.iov_len = 4;
+        netbuf_enqueue(&mgr, &iov);
+        total += 4;
+    }
+#ifndef NETBUFS_LIBC_PROXY
+    ASSERT_EQ(1, netbuf_get_niov(&mgr));
+    ASSERT_EQ(1, mgr.sendq.nowned);
+#endif
+    /** The caller's buffer may be modified right away */
+    src[0] = 'X';
+
+    /** Larger buffers are referenced */
+    iov.iov_base = big;
+    iov.iov_len = sizeof(big);
+    netbuf_enqueue(&mgr, &iov);
+    total += sizeof(big);
+
+    iov.iov_base = src + 1;
+    iov.iov_len = 4;
+    netbuf_enqueue(&mgr, &iov);
+    total += 4;
+    ASSERT_NE(src + 1, (char *)mgr.sendq.ring[(mgr.sendq.head +
+                                               mgr.sendq.count - 1) &
+                                              (mgr.sendq.nalloc - 1)].iov_base);
+
+    /** A partial flush does not release the copies */
+    niov = 0;
+    nflushed = netbuf_start_flush(&mgr, out, 16, &niov);
+    ASSERT_EQ(total, nflushed);
+    ASSERT_EQ(0, ((char *)out[0].iov_base)[0]);
+    nflushed = 0;
+    for (ii = 0; ii < niov; ii++) {
+        memcpy(dst + nflushed, out[ii].iov_base, out[ii].iov_len);
+        nflushed += out[ii].iov_len;
+    }
+    ASSERT_EQ(0, memcmp(dst + 32, big, sizeof(big)));
+    ASSERT_EQ(0, memcmp(dst + 32 + sizeof(big), src + 1, 4));
+
+    netbuf_end_flush(&mgr, 20);
+    ASSERT_NE(0, mgr.sendq.nowned);
+    netbuf_end_flush(&mgr, 12);
+    ASSERT_EQ(1, mgr.sendq.nowned);
+    netbuf_end_flush(&mgr, total - 32);
+    ASSERT_EQ(0, mgr.sendq.nowned);
+    ASSERT_EQ(1, DLIST_IS_EMPTY(&mgr.datapool.active));
+
+    /** Copies which were never flushed are released on cleanup */
+    iov.iov_base = src;
+    iov.iov_len = 8;
+    netbuf_enqueue(&mgr, &iov);
+    netbuf_cleanup(&mgr);
+    ASSERT_EQ(0, mgr.total_bytes);
+}
+
+static void test_sendq_ring(void)
+{
+    nb_MGR mgr;
+    nb_SETTINGS settings;
+    nb_IOV iov, out[64];
+    char buf[256];
+    nb_SIZE nflushed;
+    int ii, niov;
+
+    netbuf_default_settings(&settings);
+    settings.sndq_cacheblocks = 1;
+    settings.sndq_basealloc = 1;
+    netbuf_init(&mgr, &settings);
+
+    /** Entries wrap around the end of the array */
+    for (ii = 0; ii < 12; ii++) {
+        iov.iov_base = buf + ii * 2;
+        iov.iov_len = 1;
+        netbuf_enqueue(&mgr, &iov);
+    }
+    ASSERT_EQ(16, mgr.sendq.nalloc);
+    nflushed = netbuf_start_flush(&mgr, out, 10, &niov);
+    ASSERT_EQ(10, nflushed);
+    ASSERT_EQ(10, niov);
+    netbuf_end_flush(&mgr, nflushed);
+    ASSERT_EQ(2, netbuf_get_niov(&mgr));
+
+    for (ii = 12; ii < 24; ii++) {
+        iov.iov_base = buf + ii * 2;
+        iov.iov_len = 1;
+        netbuf_enqueue(&mgr, &iov);
+    }
+    ASSERT_EQ(16, mgr.sendq.nalloc);
+    ASSERT_EQ(14, netbuf_get_niov(&mgr));
+
+    /** Entries in flight are not returned again */
+    nflushed = netbuf_start_flush(&mgr, out, 4, &niov);
+    ASSERT_EQ(4, nflushed);
+    ASSERT_EQ(buf + 20, out[0].iov_base);
+    ASSERT_EQ(buf + 26, out[3].iov_base);
+
+    /** The array grows while entries are in flight */
+    for (ii = 24; ii < 100; ii++) {
+        iov.iov_base = buf + ii * 2;
+        iov.iov_len = 1;
+        netbuf_enqueue(&mgr, &iov);
+    }
+    ASSERT_EQ(128, mgr.sendq.nalloc);
+    ASSERT_EQ(90, netbuf_get_niov(&mgr));
+
+    nflushed = netbuf_start_flush(&mgr, out, 64, &niov);
+    ASSERT_EQ(64, nflushed);
+    for (ii = 0; ii < niov; ii++) {
+        ASSERT_EQ(buf + 28 + ii * 2, out[ii].iov_base);
+    }
+    netbuf_end_flush(&mgr, 4);
+    netbuf_end_flush(&mgr, 64);
+    ASSERT_EQ(22, netbuf_get_niov(&mgr));
+
+    nflushed = netbuf_start_flush(&mgr, out, 64, &niov);
+    ASSERT_EQ(22, nflushed);
+    ASSERT_EQ(buf + 156, out[0].iov_base);
+    netbuf_end_flush(&mgr, nflushed);
+    ASSERT_EQ(0, netbuf_get_niov(&mgr));
+    ASSERT_EQ(0, netbuf_start_flush(&mgr, out, 64, &niov));
+
+    /** An empty queue's array is returned by netbuf_trim() */
+    netbuf_trim(&mgr);
+    ASSERT_EQ(0, mgr.sendq.nalloc);
+    iov.iov_base = buf;
+    iov.iov_len = 1;
+    netbuf_enqueue(&mgr, &iov);
+    ASSERT_EQ(1, netbuf_get_niov(&mgr));
+
+    netbuf_cleanup(&mgr);
+    ASSERT_EQ(0, mgr.total_bytes);
+}
+
+static void test_sendq_nomem(void)
+{
+    nb_MGR mgr;
+    nb_SETTINGS settings;
+    nb_SPAN span;
+    nb_IOV iov;
+    nb_SHARED shared;
+    char buf[64];
+    unsigned int remaining = 100;
+    nb_SIZE size;
+    int ii;
+
+    netbuf_default_settings(&settings);
+    settings.sndq_cacheblocks = 1;
+    settings.sndq_basealloc = 1;
+    settings.allocator.alloc = test_alloc_limited;
+    settings.allocator.free = test_free_limited;
+    settings.allocator.ctx = &remaining;
+    netbuf_init(&mgr, &settings);
+
+    /** A block with room, and a full queue */
+    span.size = 10;
+    ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &span));
+    netbuf_mblock_release(&mgr, &span);
+    for (ii = 0; ii < 16; ii++) {
+        iov.iov_base = buf + ii * 2;
+        iov.iov_len = 1;
+        netbuf_enqueue(&mgr, &iov);
+    }
+    ASSERT_EQ(16, mgr.sendq.nalloc);
+
+    /** The queue cannot grow, so nothing is enqueued */
+    remaining = 0;
+    iov.iov_base = buf;
+    iov.iov_len = 10;
+    ASSERT_EQ(-1, netbuf_enqueue_copy(&mgr, &iov, 1, &span));
+    ASSERT_EQ(16, netbuf_get_size(&mgr));
+    ASSERT_EQ(16, netbuf_get_niov(&mgr));
+
+    remaining = 100;
+    ASSERT_EQ(0, netbuf_enqueue_copy(&mgr, &iov, 1, &span));
+    ASSERT_EQ(26, netbuf_get_size(&mgr));
+    netbuf_mblock_release(&mgr, &span);
+
+    /** Neither owned spans nor shared buffers are recorded then */
+    ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &span));
+    ASSERT_EQ(0, netbuf_enqueue_span_owned(&mgr, &span));
+    for (ii = 0; netbuf_get_niov(&mgr) < mgr.sendq.nalloc; ii++) {
+        iov.iov_base = buf + ii * 2;
+        iov.iov_len = 1;
+        netbuf_enqueue(&mgr, &iov);
+    }
+    size = netbuf_get_size(&mgr);
+    ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &span));
+    remaining = 0;
+    ASSERT_EQ(-1, netbuf_enqueue_span_owned(&mgr, &span));
+    ASSERT_EQ(1, mgr.sendq.nowned);
+    netbuf_shared_init(&shared, buf, sizeof(buf), NULL);
+    ASSERT_EQ(-1, netbuf_enqueue_shared(&mgr, &shared));
+    ASSERT_EQ(1, shared.refcount);
+    ASSERT_EQ(1, mgr.sendq.nowned);
+    ASSERT_EQ(size, netbuf_get_size(&mgr));
+    remaining = 100;
+    netbuf_mblock_release(&mgr, &span);
+
+    /** A deferred release which cannot be recorded keeps the span reserved */
+    ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &span));
+    remaining = 0;
+    ASSERT_EQ(-1, netbuf_mblock_release_deferred(&mgr, &span));
+    ASSERT_EQ(0, mgr.ndeferred);
+    remaining = 100;
+    ASSERT_EQ(0, netbuf_mblock_release_deferred(&mgr, &span));
+    ASSERT_EQ(1, mgr.ndeferred);
+    netbuf_cleanup(&mgr);
+}
+
+static void test_sendq_counters(void)
+{
+    nb_MGR mgr;
+    nb_IOV iov, out[8];
+    char buf[256];
+    int niov;
+
+    netbuf_init(&mgr, NULL);
+    ASSERT_EQ(0, netbuf_get_size(&mgr));
+    ASSERT_EQ(0, netbuf_get_inflight(&mgr));
+
+    iov.iov_base = buf;
+    iov.iov_len = 100;
+    netbuf_enqueue(&mgr, &iov);
+    iov.iov_base = buf + 150;
+    iov.iov_len = 50;
+    netbuf_enqueue(&mgr, &iov);
+    ASSERT_EQ(150, netbuf_get_size(&mgr));
+    ASSERT_EQ(0, netbuf_get_inflight(&mgr));
+
+    ASSERT_EQ(30, netbuf_start_flush2(&mgr, out, 8, &niov, 30));
+    ASSERT_EQ(120, netbuf_start_flush(&mgr, out, 8, &niov));
+    ASSERT_EQ(150, netbuf_get_inflight(&mgr));
+
+    /** More data while the first is in flight */
+    iov.iov_base = buf + 200;
+    iov.iov_len = 10;
+    netbuf_enqueue(&mgr, &iov);
+    ASSERT_EQ(160, netbuf_get_size(&mgr));
+    ASSERT_EQ(150, netbuf_get_inflight(&mgr));
+
+    netbuf_end_flush(&mgr, 30);
+    ASSERT_EQ(130, netbuf_get_size(&mgr));
+    ASSERT_EQ(120, netbuf_get_inflight(&mgr));
+    ASSERT_EQ(30, netbuf_get_flushed(&mgr));
+
+    /** A short write for the last request returns its remainder again */
+    netbuf_end_flush(&mgr, 100);
+    ASSERT_EQ(30, netbuf_get_size(&mgr));
+    ASSERT_EQ(0, netbuf_get_inflight(&mgr));
+    ASSERT_EQ(30, netbuf_start_flush(&mgr, out, 8, &niov));
+    ASSERT_EQ(30, netbuf_get_inflight(&mgr));
+
+    netbuf_end_flush(&mgr, 30);
+    ASSERT_EQ(0, netbuf_get_size(&mgr));
+    ASSERT_EQ(0, netbuf_get_inflight(&mgr));
+    ASSERT_EQ(160, netbuf_get_flushed(&mgr));
+    ASSERT_EQ(0, netbuf_get_niov(&mgr));
+
+    netbuf_cleanup(&mgr);
+}
+
+static void test_flush_budget(void)
+{
+    nb_MGR mgr;
+    static nb_IOV out[2048];
+    static char buf[4096];
+    nb_IOV iov;
+    nb_SIZE nflushed;
+    int ii, niov;
+
+    netbuf_init(&mgr, NULL);
+    for (ii = 0; ii < 3; ii++) {
+        iov.iov_base = buf + ii * 200;
+        iov.iov_len = 100;
+        netbuf_enqueue(&mgr, &iov);
+    }
+
+    /** The budget splits the second buffer */
+    ASSERT_EQ(150, netbuf_start_flush2(&mgr, out, 8, &niov, 150));
+    ASSERT_EQ(2, niov);
+    ASSERT_EQ(50, out[1].iov_len);
+    ASSERT_EQ(0, netbuf_start_flush2(&mgr, out, 8, &niov, 0));
+
+    /** The rest of it follows, again split by the budget */
+    ASSERT_EQ(20, netbuf_start_flush2(&mgr, out, 8, &niov, 20));
+    ASSERT_EQ(1, niov);
+    ASSERT_EQ(buf + 250, out[0].iov_base);
+    ASSERT_EQ(130, netbuf_start_flush2(&mgr, out, 8, &niov, 1000));
+    ASSERT_EQ(2, niov);
+    ASSERT_EQ(buf + 270, out[0].iov_base);
+    ASSERT_EQ(30, out[0].iov_len);
+    ASSERT_EQ(100, out[1].iov_len);
+    ASSERT_EQ(300, netbuf_get_inflight(&mgr));
+
+    netbuf_end_flush(&mgr, 150);
+    netbuf_end_flush(&mgr, 20);
+    netbuf_end_flush(&mgr, 130);
+    ASSERT_EQ(0, netbuf_get_size(&mgr));
+
+    /** A budget ending within the last requested buffer */
+    iov.iov_base = buf;
+    iov.iov_len = 100;
+    netbuf_enqueue(&mgr, &iov);
+    ASSERT_EQ(40, netbuf_start_flush2(&mgr, out, 8, &niov, 40));
+    netbuf_end_flush(&mgr, 40);
+    ASSERT_EQ(60, netbuf_start_flush2(&mgr, out, 8, &niov, 1000));
+    ASSERT_EQ(buf + 40, out[0].iov_base);
+    netbuf_end_flush(&mgr, 60);
+
+    /** Several budgeted requests in flight from the same entry */
+    iov.iov_base = buf;
+    iov.iov_len = 100;
+    netbuf_enqueue(&mgr, &iov);
+    ASSERT_EQ(40, netbuf_start_flush2(&mgr, out, 8, &niov, 40));
+    ASSERT_EQ(40, netbuf_start_flush2(&mgr, out, 8, &niov, 40));
+    ASSERT_EQ(buf + 40, out[0].iov_base);
+    netbuf_end_flush(&mgr, 40);
+    ASSERT_EQ(40, netbuf_get_inflight(&mgr));
+    ASSERT_EQ(20, netbuf_start_flush(&mgr, out, 8, &niov));
+    ASSERT_EQ(buf + 80, out[0].iov_base);
+    ASSERT_EQ(60, netbuf_get_inflight(&mgr));
+    netbuf_end_flush(&mgr, 40);
+    ASSERT_EQ(20, netbuf_get_inflight(&mgr));
+    ASSERT_EQ(0, netbuf_start_flush(&mgr, out, 8, &niov));
+    netbuf_end_flush(&mgr, 20);
+    ASSERT_EQ(0, netbuf_get_inflight(&mgr));
+    ASSERT_EQ(0, netbuf_get_size(&mgr));
+
+    /** A short write for the last of them returns the remainder again */
+    netbuf_enqueue(&mgr, &iov);
+    ASSERT_EQ(40, netbuf_start_flush2(&mgr, out, 8, &niov, 40));
+    ASSERT_EQ(40, netbuf_start_flush2(&mgr, out, 8, &niov, 40));
+    netbuf_end_flush(&mgr, 40);
+    netbuf_end_flush(&mgr, 10);
+    ASSERT_EQ(0, netbuf_get_inflight(&mgr));
+    ASSERT_EQ(50, netbuf_start_flush(&mgr, out, 8, &niov));
+    ASSERT_EQ(buf + 50, out[0].iov_base);
+    netbuf_end_flush(&mgr, 50);
+
+    /** No more than IOV_MAX buffers are returned at once */
+    for (ii = 0; ii < 2000; ii++) {
+        iov.iov_base = buf + ii * 2;
+        iov.iov_len = 1;
+        netbuf_enqueue(&mgr, &iov);
+    }
+    nflushed = netbuf_start_flush(&mgr, out, 2048, &niov);
+    ASSERT_EQ(1, niov <= 1024);
+    ASSERT_EQ((nb_SIZE)niov, nflushed);
+    netbuf_end_flush(&mgr, nflushed);
+    while ((nflushed = netbuf_start_flush(&mgr, out, 2048, NULL))) {
+        netbuf_end_flush(&mgr, nflushed);
+    }
+    ASSERT_EQ(0, netbuf_get_size(&mgr));
+
+    netbuf_cleanup(&mgr);
+}
+
+#define FLUSH_FD_NSPANS 512
+#define FLUSH_FD_SPANSIZE 1000
+
+#ifndef _WIN32
+/** Reads everything currently available from a non-blocking descriptor */
+static size_t drain_fd(int fd, char *dst, size_t max)
+{
+    size_t total = 0;
+    ssize_t nr;
+    while (total < max && (nr = read(fd, dst + total, max - total)) > 0) {
+        total += nr;
+    }
+    return total;
+}
+#endif
+
+static void test_flush_fd(void)
+{
+#ifndef _WIN32
+    nb_MGR mgr;
+    nb_SPAN spans[FLUSH_FD_NSPANS];
+    static char dst[FLUSH_FD_NSPANS * FLUSH_FD_SPANSIZE];
+    char expected[FLUSH_FD_SPANSIZE];
+    nb_FLUSHSTATUS status;
+    nb_IOV iov;
+    size_t nread = 0;
+    int fds[2], ii, nagain = 0;
+
+    netbuf_init(&mgr, NULL);
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+
+    for (ii = 0; ii < FLUSH_FD_NSPANS; ii++) {
+        spans[ii].size = FLUSH_FD_SPANSIZE;
+        ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, spans + ii));
+        memset(SPAN_BUFFER(spans + ii), ii, FLUSH_FD_SPANSIZE);
+        netbuf_enqueue_span(&mgr, spans + ii);
+    }
+
+    /** More data than the socket can buffer */
+    while ((status = netbuf_flush_fd(&mgr, fds[0], 0)) == NB_FLUSH_AGAIN) {
+        nagain++;
+        ASSERT_EQ(0, netbuf_get_inflight(&mgr));
+        nread += drain_fd(fds[1], dst + nread, sizeof(dst) - nread);
+    }
+    ASSERT_EQ(NB_FLUSH_DONE, status);
+    ASSERT_NE(0, nagain);
+    ASSERT_EQ(0, netbuf_get_size(&mgr));
+    nread += drain_fd(fds[1], dst + nread, sizeof(dst) - nread);
+    ASSERT_EQ(sizeof(dst), nread);
+
+    for (ii = 0; ii < FLUSH_FD_NSPANS; ii++) {
+        memset(expected, ii, FLUSH_FD_SPANSIZE);
+        ASSERT_EQ(0, memcmp(dst + ii * FLUSH_FD_SPANSIZE, expected,
+                            FLUSH_FD_SPANSIZE));
+        netbuf_mblock_release(&mgr, spans + ii);
+    }
+
+    /** A peer which went away is an error, and does not raise SIGPIPE */
+    close(fds[1]);
+    iov.iov_base = expected;
+    iov.iov_len = 10;
+    netbuf_enqueue(&mgr, &iov);
+    ASSERT_EQ(NB_FLUSH_ERROR, netbuf_flush_fd(&mgr, fds[0], 0));
+    ASSERT_EQ(EPIPE, errno);
+    ASSERT_EQ(10, netbuf_get_size(&mgr));
+    close(fds[0]);
+
+    /** Descriptors which are not sockets are written with writev() */
+    ASSERT_EQ(0, pipe(fds));
+    iov.iov_base = expected + 20;
+    iov.iov_len = 5;
+    netbuf_enqueue(&mgr, &iov);
+    ASSERT_EQ(NB_FLUSH_DONE, netbuf_flush_fd(&mgr, fds[1], 0));
+    ASSERT_EQ(15, read(fds[0], dst, sizeof(dst)));
+    ASSERT_EQ(0, memcmp(dst, expected, 10));
+    ASSERT_EQ(0, memcmp(dst + 10, expected + 20, 5));
+
+    /** The fallback is remembered, so later flushes skip sendmsg() */
+    ASSERT_EQ(1, mgr.sendq.use_writev);
+    netbuf_enqueue(&mgr, &iov);
+    ASSERT_EQ(NB_FLUSH_DONE, netbuf_flush_fd(&mgr, fds[1], 0));
+    ASSERT_EQ(5, read(fds[0], dst, sizeof(dst)));
+    ASSERT_EQ(0, memcmp(dst, expected + 20, 5));
+    close(fds[0]);
+    close(fds[1]);
+
+    netbuf_cleanup(&mgr);
+#endif
+}
+
+#ifdef NETBUFS_HAVE_URING
+#define URING_NCONNS 4
+
+static int uring_last_result;
+static void uring_done(nb_URINGCONN *conn, int result)
+{
+    (void)conn;
+    uring_last_result = result;
+}
+#endif
+
+static void test_uring(void)
+{
+#ifdef NETBUFS_HAVE_URING
+    nb_URING ring;
+    nb_MGR mgrs[URING_NCONNS + 1];
+    nb_URINGCONN conns[URING_NCONNS + 1];
+    int fds[URING_NCONNS + 1][2];
+    static char src[65536], dst[URING_NCONNS + 1][32768];
+    size_t nread[URING_NCONNS + 1];
+    nb_IOV iov;
+    int ii, jj, pending;
+
+    if (netbuf_uring_init(&ring, 8) != 0) {
+        printf("io_uring not available, skipping\n");
+        return;
+    }
+
+    for (ii = 0; ii < (int)sizeof(src); ii++) {
+        src[ii] = (char)(ii * 13);
+    }
+
+    /** Several socket connections, and a pipe */
+    for (ii = 0; ii <= URING_NCONNS; ii++) {
+        if (ii < URING_NCONNS) {
+            ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds[ii]));
+        } else {
+            ASSERT_EQ(0, pipe(fds[ii]));
+        }
+        fcntl(fds[ii][0], F_SETFL, fcntl(fds[ii][0], F_GETFL) | O_NONBLOCK);
+        netbuf_init(mgrs + ii, NULL);
+        netbuf_uring_conn_init(conns + ii, mgrs + ii, fds[ii][1]);
+        nread[ii] = 0;
+
+        /** Many small non-contiguous buffers */
+        for (jj = 0; jj < (int)sizeof(src); jj += 512) {
+            iov.iov_base = src + jj;
+            iov.iov_len = 256;
+            netbuf_enqueue(mgrs + ii, &iov);
+        }
+        ASSERT_EQ(128, netbuf_get_niov(mgrs + ii));
+    }
+
+    do {
+        int nprepared = 0;
+        pending = 0;
+        for (ii = 0; ii <= URING_NCONNS; ii++) {
+            int rv = netbuf_uring_flush(&ring, conns + ii);
+            ASSERT_NE(-1, rv);
+            nprepared += rv;
+            /** A connection has a single write in flight */
+            ASSERT_EQ(0, netbuf_uring_flush(&ring, conns + ii));
+        }
+        ASSERT_EQ(nprepared, netbuf_uring_submit(&ring, nprepared ? 1 : 0));
+        netbuf_uring_complete(&ring, uring_done);
+        ASSERT_EQ(1, uring_last_result >= 0);
+
+        for (ii = 0; ii <= URING_NCONNS; ii++) {
+            ssize_t nr;
+            while ((nr = read(fds[ii][0], dst[ii] + nread[ii],
+                              sizeof(dst[ii]) - nread[ii])) > 0) {
+                nread[ii] += nr;
+            }
+            if (netbuf_get_size(mgrs + ii) || conns[ii].busy) {
+                pending = 1;
+            }
+        }
+    } while (pending);
+
+    for (ii = 0; ii <= URING_NCONNS; ii++) {
+        ASSERT_EQ(sizeof(dst[ii]), nread[ii]);
+        for (jj = 0; jj < 128; jj++) {
+            ASSERT_EQ(0, memcmp(src + jj * 512, dst[ii] + jj * 256, 256));
+        }
+    }
+    ASSERT_EQ(1, conns[URING_NCONNS].use_writev);
+    ASSERT_EQ(0, conns[0].use_writev);
+
+    /** Errors are reported, and the data remains queued */
+    close(fds[0][0]);
+    iov.iov_base = src;
+    iov.iov_len = 100;
+    netbuf_enqueue(mgrs, &iov);
+    ASSERT_EQ(1, netbuf_uring_flush(&ring, conns));
+    ASSERT_EQ(1, netbuf_uring_submit(&ring, 1));
+    ASSERT_EQ(1, netbuf_uring_complete(&ring, uring_done));
+    ASSERT_EQ(-EPIPE, uring_last_result);
+    ASSERT_EQ(100, netbuf_get_size(mgrs));
+    ASSERT_EQ(0, netbuf_get_inflight(mgrs));
+    close(fds[0][1]);
+
+    for (ii = 0; ii <= URING_NCONNS; ii++) {
+        if (ii) {
+            close(fds[ii][0]);
+            close(fds[ii][1]);
+        }
+        netbuf_cleanup(mgrs + ii);
+    }
+    netbuf_uring_cleanup(&ring);
+#endif
+}
+
+#ifndef _WIN32
+/** Creates a connected pair of loopback TCP sockets */
+static int tcp_pair(int fds[2])
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int lsock = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (lsock < 0 ||
+            bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(lsock, 1) != 0 ||
+            getsockname(lsock, (struct sockaddr *)&addr, &addrlen) != 0) {
+        return -1;
+    }
+
+    fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fds[0], (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        return -1;
+    }
+    fds[1] = accept(lsock, NULL, NULL);
+    close(lsock);
+    return fds[1] < 0 ? -1 : 0;
+}
+#endif
+
+#if defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SYS_sendmsg)
+#define TEST_HAVE_SENDMSG_HOOK
+/**
+ * Number of MSG_ZEROCOPY writes to fail with ENOBUFS, as the kernel does when
+ * the socket's option memory is exhausted. This definition takes the place
+ * of the libc one, for netbufs.c as well.
+ */
+static int sendmsg_zc_enobufs;
+
+ssize_t sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+    if ((flags & MSG_ZEROCOPY) && sendmsg_zc_enobufs) {
+        sendmsg_zc_enobufs--;
+        errno = ENOBUFS;
+        return -1;
+    }
+    return (ssize_t)syscall(SYS_sendmsg, fd, msg, flags);
+}
+#endif
+
+static void test_zerocopy(void)
+{
+#ifndef _WIN32
+    nb_MGR mgr;
+    nb_SETTINGS settings;
+    nb_SPAN span;
+    static char dst[5 * 65536];
+    size_t nread = 0, expected = 0;
+    int fds[2], ii, tries;
+
+    if (tcp_pair(fds) != 0) {
+        printf("loopback TCP not available, skipping\n");
+        return;
+    }
+
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+    netbuf_default_settings(&settings);
+    settings.zerocopy_threshold = 4096;
+    netbuf_init(&mgr, &settings);
+    if (netbuf_zerocopy_enable(&mgr, fds[0]) != 0) {
+        printf("MSG_ZEROCOPY not available, skipping\n");
+        netbuf_cleanup(&mgr);
+        close(fds[0]);
+        close(fds[1]);
+        return;
+    }
+
+    /** Small writes are copied, and released once flushed */
+    span.size = 100;
+    ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &span));
+    memset(SPAN_BUFFER(&span), 'S', span.size);
+    ASSERT_EQ(0, netbuf_enqueue_span_owned(&mgr, &span));
+    expected += span.size;
+    ASSERT_EQ(NB_FLUSH_DONE, netbuf_flush_fd(&mgr, fds[0], 0));
+    ASSERT_EQ(0, netbuf_get_zerocopy_pending(&mgr));
+    ASSERT_EQ(0, mgr.sendq.nowned);
+
+    /**
+     * Large writes are only released once the kernel is done with them. This
+     * includes deferred releases, which are otherwise applied by the
+     * netbuf_end_flush() within netbuf_flush_fd()
+     */
+    for (ii = 0; ii < 4; ii++) {
+        span.size = 65536;
+        ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &span));
+        memset(SPAN_BUFFER(&span), 'A' + ii, span.size);
+        if (ii == 3) {
+            netbuf_enqueue_span(&mgr, &span);
+            ASSERT_EQ(0, netbuf_mblock_release_deferred(&mgr, &span));
+        } else {
+            ASSERT_EQ(0, netbuf_enqueue_span_owned(&mgr, &span));
+        }
+        expected += span.size;
+    }
+
+    while (netbuf_flush_fd(&mgr, fds[0], 0) == NB_FLUSH_AGAIN ||
+            nread < expected) {
+        ssize_t nr = read(fds[1], dst + nread, sizeof(dst) - nread);
+        ASSERT_EQ(1, nr > 0);
+        nread += nr;
+    }
+    ASSERT_EQ(0, netbuf_get_size(&mgr));
+    ASSERT_NE(0, netbuf_get_zerocopy_pending(&mgr));
+    ASSERT_NE(0, mgr.sendq.nowned);
+    ASSERT_EQ(1, mgr.ndeferred);
+
+    for (tries = 0; tries < 100 && netbuf_get_zerocopy_pending(&mgr); tries++) {
+        struct pollfd pfd;
+        pfd.fd = fds[0];
+        pfd.events = 0;
+        poll(&pfd, 1, 10);
+        ASSERT_NE(-1, netbuf_zerocopy_complete(&mgr, fds[0]));
+    }
+    ASSERT_EQ(0, netbuf_get_zerocopy_pending(&mgr));
+    ASSERT_EQ(0, mgr.sendq.nowned);
+    ASSERT_EQ(0, mgr.ndeferred);
+#ifndef NETBUFS_LIBC_PROXY
+    ASSERT_EQ(1, DLIST_IS_EMPTY(&mgr.datapool.active));
+#endif
+
+    ASSERT_EQ(expected, nread);
+    ASSERT_EQ('S', dst[99]);
+    for (ii = 0; ii < 4; ii++) {
+        ASSERT_EQ('A' + ii, dst[100 + ii * 65536]);
+        ASSERT_EQ('A' + ii, dst[100 + ii * 65536 + 65535]);
+    }
+
+#ifdef TEST_HAVE_SENDMSG_HOOK
+    /** Without memory for the notification, the write is copied instead */
+    span.size = 65536;
+    ASSERT_EQ(0, netbuf_mblock_reserve(&mgr, &span));
+    memset(SPAN_BUFFER(&span), 'E', span.size);
+    ASSERT_EQ(0, netbuf_enqueue_span_owned(&mgr, &span));
+    expected = span.size;
+    nread = 0;
+    sendmsg_zc_enobufs = 1;
+    ASSERT_NE(NB_FLUSH_ERROR, netbuf_flush_fd(&mgr, fds[0], 0));
+    ASSERT_EQ(0, sendmsg_zc_enobufs);
+    while (netbuf_flush_fd(&mgr, fds[0], 0) == NB_FLUSH_AGAIN ||
+            nread < expected) {
+        ssize_t nr = read(fds[1], dst + nread, sizeof(dst) - nread);
+        ASSERT_EQ(1, nr > 0);
+        nread += nr;
+    }
+    ASSERT_EQ(expected, nread);
+    ASSERT_EQ('E', dst[0]);
+    ASSERT_EQ('E', dst[65535]);
+    ASSERT_EQ(0, netbuf_get_size(&mgr));
+
+    /** Anything after a short write may still have used MSG_ZEROCOPY */
+    for (tries = 0; tries < 100 && netbuf_get_zerocopy_pending(&mgr); tries++) {
+        struct pollfd pfd;
+        pfd.fd = fds[0];
+        pfd.events = 0;
+        poll(&pfd, 1, 10);
+        ASSERT_NE(-1, netbuf_zerocopy_complete(&mgr, fds[0]));
+    }
+    ASSERT_EQ(0, mgr.sendq.nowned);
+#endif
+
+    close(fds[0]);
+    close(fds[1]);
+    netbuf_cleanup(&mgr);
+    ASSERT_EQ(0, mgr.total_bytes);
+#endif
+}
+
+/** Simulates readv() of 'len' bytes into the buffers from the read buffer */
+static nb_SIZE rdbuf_fill(nb_RDBUF *rdbuf, const char *src, nb_SIZE len)
+{
+    nb_IOV iovs[4];
+    nb_SIZE nread = 0;
+    int ii, niov = netbuf_rdbuf_prepare(rdbuf, iovs, 4, len);
+
+    ASSERT_NE(-1, niov);
+    for (ii = 0; ii < niov && nread < len; ii++) {
+        nb_SIZE n = len - nread;
+        if (n > iovs[ii].iov_len) {
+            n = iovs[ii].iov_len;
+        }
+        memcpy(iovs[ii].iov_base, src + nread, n);
+        nread += n;
+    }
+    ASSERT_EQ(0, netbuf_rdbuf_commit(rdbuf, nread));
+    return nread;
+}
+
+static void test_rdbuf(void)
+{
+    nb_MGR mgr;
+    nb_SETTINGS settings;
+    nb_RDBUF rdbuf;
+    nb_SPAN spans[4];
+    nb_IOV iovs[4];
+    char src[2000], value[64];
+    unsigned char hdr;
+    nb_SIZE fed = 0, pos = 0, len;
+    int ii, nspans, nrecords = 0;
+
+    /** Records of a one byte length followed by the value */
+    for (ii = 0; ii < (int)sizeof(src); ) {
+        int vlen = (ii * 7) % 61;
+        if (ii + 1 + vlen > (int)sizeof(src)) {
+            vlen = sizeof(src) - ii - 1;
+        }
+        src[ii++] = (char)vlen;
+        while (vlen--) {
+            src[ii] = (char)ii;
+            ii++;
+        }
+    }
+
+    netbuf_default_settings(&settings);
+    settings.data_basealloc = 256;
+    netbuf_init(&mgr, &settings);
+    netbuf_rdbuf_init(&rdbuf, &mgr);
+    ASSERT_EQ(256, rdbuf.segsize);
+    rdbuf.segsize = 100;
+
+    ASSERT_EQ(NULL, netbuf_rdbuf_contig(&rdbuf, &len));
+    ASSERT_EQ(-1, netbuf_rdbuf_peek(&rdbuf, &hdr, 1));
+
+    /** With no minimum, the room left in the existing segment is returned */
+    ASSERT_EQ(1, netbuf_rdbuf_prepare(&rdbuf, iovs, 4, 0));
+    ASSERT_EQ(100, iovs[0].iov_len);
+    fed += rdbuf_fill(&rdbuf, src, 30);
+    ASSERT_EQ(1, netbuf_rdbuf_prepare(&rdbuf, iovs, 4, 0));
+    ASSERT_EQ(70, iovs[0].iov_len);
+    ASSERT_EQ(3, netbuf_rdbuf_prepare(&rdbuf, iovs, 4, 250));
+    ASSERT_EQ(3, rdbuf.nsegs);
+
+    /** No more than the prepared room can be committed */
+    ASSERT_EQ(-1, netbuf_rdbuf_commit(&rdbuf, 271));
+    ASSERT_EQ(30, netbuf_rdbuf_get_size(&rdbuf));
+    ASSERT_EQ(0, rdbuf.fillix);
+    ASSERT_EQ(1, netbuf_rdbuf_prepare(&rdbuf, iovs, 1, 250));
+    ASSERT_EQ(-1, netbuf_rdbuf_commit(&rdbuf, 71));
+    ASSERT_EQ(30, netbuf_rdbuf_get_size(&rdbuf));
+    ASSERT_EQ(0, memcmp(netbuf_rdbuf_contig(&rdbuf, &len), src, 30));
+    ASSERT_EQ(30, len);
+
+    while (pos < sizeof(src)) {
+        if (fed < sizeof(src)) {
+            nb_SIZE n = sizeof(src) - fed;
+            fed += rdbuf_fill(&rdbuf, src + fed, n > 37 ? 37 : n);
+        }
+
+        while (netbuf_rdbuf_peek(&rdbuf, &hdr, 1) == 0 &&
+                netbuf_rdbuf_get_size(&rdbuf) >= 1 + (nb_SIZE)hdr) {
+            netbuf_rdbuf_consume(&rdbuf, 1);
+            pos++;
+            if (!hdr) {
+                continue;
+            }
+
+            if (nrecords++ % 2) {
+                ASSERT_EQ(0, netbuf_rdbuf_peek(&rdbuf, value, hdr));
+                ASSERT_EQ(0, memcmp(value, src + pos, hdr));
+                netbuf_rdbuf_consume(&rdbuf, hdr);
+                pos += hdr;
+                continue;
+            }
+
+            /** Keep the value without copying it */
+            ASSERT_EQ(-1, netbuf_rdbuf_refspan(&rdbuf, hdr, spans, 0));
+            nspans = netbuf_rdbuf_refspan(&rdbuf, hdr, spans, 4);
+            ASSERT_NE(-1, nspans);
+            for (ii = 0; ii < nspans; ii++) {
+                ASSERT_EQ(0, memcmp(SPAN_BUFFER(spans + ii), src + pos,
+                                    spans[ii].size));
+                pos += spans[ii].size;
+#ifndef NETBUFS_LIBC_PROXY
+                ASSERT_EQ(1, spans[ii].parent->nalloc == 256);
+#endif
+            }
+            netbuf_mblock_release_many(&mgr, spans, nspans);
+        }
+    }
+    ASSERT_EQ(sizeof(src), pos);
+    ASSERT_EQ(0, netbuf_rdbuf_get_size(&rdbuf));
+    ASSERT_EQ(-1, netbuf_rdbuf_refspan(&rdbuf, 1, spans, 4));
+    ASSERT_EQ(-1, netbuf_rdbuf_consume(&rdbuf, 1));
+
+    netbuf_rdbuf_cleanup(&rdbuf);
+    ASSERT_EQ(100, rdbuf.segsize);
+#ifndef NETBUFS_LIBC_PROXY
+    ASSERT_EQ(1, DLIST_IS_EMPTY(&mgr.datapool.active));
+#endif
+
+    /** A value spanning two segments needs two spans */
+    fed = rdbuf_fill(&rdbuf, src, 150);
+    ASSERT_EQ(150, fed);
+    ASSERT_EQ(-1, netbuf_rdbuf_consume(&rdbuf, 151));
+    ASSERT_EQ(150, netbuf_rdbuf_get_size(&rdbuf));
+    ASSERT_EQ(0, netbuf_rdbuf_consume(&rdbuf, 90));
+#ifndef NETBUFS_LIBC_PROXY
+    ASSERT_EQ(-1, netbuf_rdbuf_refspan(&rdbuf, 20, spans, 1));
+    ASSERT_EQ(60, netbuf_rdbuf_get_size(&rdbuf));
+    ASSERT_EQ(2, netbuf_rdbuf_refspan(&rdbuf, 20, spans, 4));
+    ASSERT_EQ(10, spans[0].size);
+    ASSERT_EQ(10, spans[1].size);
+    ASSERT_EQ(0, memcmp(SPAN_BUFFER(spans + 1), src + 100, 10));
+    ASSERT_EQ(1, rdbuf.nsegs);
+#else
+    ASSERT_EQ(1, netbuf_rdbuf_refspan(&rdbuf, 20, spans, 1));
+#endif
+    ASSERT_EQ(0, memcmp(SPAN_BUFFER(spans), src + 90, 10));
+
+    /** Spans outlive the read buffer */
+    netbuf_rdbuf_cleanup(&rdbuf);
+    ASSERT_EQ(0, memcmp(SPAN_BUFFER(spans), src + 90, 10));
+#ifndef NETBUFS_LIBC_PROXY
+    netbuf_mblock_release_many(&mgr, spans, 2);
+    ASSERT_EQ(1, DLIST_IS_EMPTY(&mgr.datapool.active));
+#else
+    netbuf_mblock_release(&mgr, spans);
+#endif
+
+    netbuf_cleanup(&mgr);
+}
+
+static int shared_nfreed;
+static void shared_free(nb_SHARED *shared)
+{
+    shared_nfreed++;
+    (void)shared;
+}
+
+static void test_shared(void)
+{
+    nb_MGR mgrs[3];
+    nb_SETTINGS settings;
+    nb_SHARED shared, *allocated;
+    nb_ALLOCATOR allocator;
+    test_ALLOCSTATS stats;
+    nb_IOV iovs[8], iov;
+    char payload[100], small[4] = "abc";
+    nb_SIZE nb;
+    int ii, niov;
+
+    memset(payload, 'P', sizeof(payload));
+    netbuf_shared_init(&shared, payload, sizeof(payload), shared_free);
+    netbuf_default_settings(&settings);
+    settings.copy_threshold = 16;
+
+    for (ii = 0; ii < 3; ii++) {
+        netbuf_init(mgrs + ii, &settings);
+        ASSERT_EQ(0, netbuf_enqueue_shared(mgrs + ii, &shared));
+        /** Copied data is never appended to the shared buffer */
+        iov.iov_base = small;
+        iov.iov_len = 3;
+        netbuf_enqueue(mgrs + ii, &iov);
+    }
+    ASSERT_EQ(4, shared.refcount);
+
+    /** The caller may drop its reference right away */
+    netbuf_shared_unref(&shared);
+    ASSERT_EQ(0, shared_nfreed);
+
+    /** Sent without copying */
+    nb = netbuf_start_flush(mgrs, iovs, 8, &niov);
+    ASSERT_EQ(103, nb);
+    ASSERT_EQ(2, niov);
+    ASSERT_EQ(payload, iovs[0].iov_base);
+    ASSERT_EQ(0, memcmp(iovs[1].iov_base, small, 3));
+
+    /** A partial flush keeps the reference */
+    netbuf_end_flush(mgrs, 99);
+    ASSERT_EQ(3, shared.refcount);
+    netbuf_end_flush(mgrs, 1);
+    ASSERT_EQ(2, shared.refcount);
+    netbuf_end_flush(mgrs, 3);
+
+    nb = netbuf_start_flush(mgrs + 1, iovs, 8, NULL);
+    netbuf_end_flush(mgrs + 1, nb);
+    ASSERT_EQ(1, shared.refcount);
+    ASSERT_EQ(0, shared_nfreed);
+
+    /** Destroying a manager drops its references */
+    netbuf_cleanup(mgrs + 2);
+    ASSERT_EQ(1, shared_nfreed);
+
+    /** Buffers allocated by the library are freed by it */
+    memset(&stats, 0, sizeof(stats));
+    memset(&allocator, 0, sizeof(allocator));
+    allocator.alloc = test_alloc;
+    allocator.free = test_free;
+    allocator.ctx = &stats;
+    allocated = netbuf_shared_alloc(&allocator, 10);
+    ASSERT_NE(NULL, allocated);
+    ASSERT_EQ(1, stats.nallocs);
+    memset(allocated->buf, 'A', 10);
+    ASSERT_EQ(0, netbuf_enqueue_shared(mgrs, allocated));
+    ASSERT_EQ(0, netbuf_enqueue_shared(mgrs + 1, allocated));
+    netbuf_shared_unref(allocated);
+    for (ii = 0; ii < 2; ii++) {
+        nb = netbuf_start_flush(mgrs + ii, iovs, 8, NULL);
+        ASSERT_EQ(10, nb);
+        ASSERT_EQ(allocated->buf, iovs[0].iov_base);
+        netbuf_end_flush(mgrs + ii, nb);
+        netbuf_cleanup(mgrs + ii);
+    }
+    ASSERT_EQ(1, stats.nfrees);
+    ASSERT_EQ(0, stats.nbytes);
+
+    /** Without an allocator, malloc() is used */
+    allocated = netbuf_shared_alloc(NULL, 10);
+    ASSERT_NE(NULL, allocated);
+    netbuf_shared_unref(allocated);
+}
+
 int main(void)
 {
     test_basic();
@@ -363,5 +2292,30 @@ int main(void)
     test_flush();
     test_multi_flush();
     test_flush2();
+    test_avail_classes();
+    test_ooo_coalesce();
+    test_placement();
+    test_retention();
+    test_prealloc();
+    test_allocator();
+    test_mmap();
+    test_large_span();
+    test_reserve_many();
+    test_release_many();
+    test_extend_truncate();
+    test_large_fit();
+    test_writer();
+    test_aligned();
+    test_enqueue_copy();
+    test_hybrid_copy();
+    test_sendq_ring();
+    test_sendq_nomem();
+    test_sendq_counters();
+    test_flush_budget();
+    test_flush_fd();
+    test_uring();
+    test_zerocopy();
+    test_rdbuf();
+    test_shared();
     return 0;
 }